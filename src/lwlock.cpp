@@ -17,11 +17,29 @@
 
 #include "xrcu/lwlock.hpp"
 #include "xrcu/xatomic.hpp"
+#include "xrcu/xrcu.hpp"
+#include <atomic>
+#include <system_error>
+
+#if defined (__MINGW32__) || defined (__MINGW64__)
+  #include <pthread.h>
+#endif
+
+/* Layout of a reader-writer lock word. The lowest bits are flags, followed by
+ * the number of waiting writers and then the number of readers. */
+static const uintptr_t RW_WRITER = 1;
+static const uintptr_t RW_SLEEP = 2;
+static const uintptr_t RW_BIASED = 4;
+static const uintptr_t RW_WWAIT = 8;
+static const uintptr_t RW_WWAIT_MASK = 0xfff8;
+static const uintptr_t RW_READER = 0x10000;
+static const uintptr_t RW_READER_MASK = ~(RW_READER - 1);
 
 #if (defined (linux) || defined (__linux) || defined (__linux__)) &&   \
     defined (__BYTE_ORDER__)
 
 #include <linux/futex.h>
+#include <climits>
 #include <unistd.h>
 #include <syscall.h>
 
@@ -74,10 +92,75 @@ lwlock_release (uintptr_t *ptr)
              (long)(FUTEX_WAKE | FUTEX_PRIVATE_FLAG), 1ul);
 }
 
+// Wait for a queue node to be released (i.e: set to zero).
+static inline void
+clh_wait (uintptr_t *ptr)
+{
+  const int MAX_SPINS = 100;
+
+  for (int i = 0; i < MAX_SPINS; ++i)
+    {
+      if (*ptr == 0)
+        return;
+
+      xrcu::xatomic_spin_nop ();
+    }
+
+  // Tell the owner that it has to wake us up.
+  while (*ptr != 0)
+    {
+      if (*ptr == 2 || xrcu::xatomic_cas_bool (ptr, 1, 2))
+        syscall (SYS_futex, futex_ptr<sizeof (int) < sizeof (void *)> (ptr),
+                 (long)(FUTEX_WAIT | FUTEX_PRIVATE_FLAG), 2l, 0ul);
+    }
+}
+
+static inline void
+clh_wake (uintptr_t *ptr)
+{
+  if (xrcu::xatomic_swap (ptr, 0) == 2)
+    syscall (SYS_futex, futex_ptr<sizeof (int) < sizeof (void *)> (ptr),
+             (long)(FUTEX_WAKE | FUTEX_PRIVATE_FLAG), 1ul);
+}
+
+// Wait until none of the bits in MASK are set in a reader-writer lock.
+static void
+rw_wait (uintptr_t *ptr, uintptr_t mask)
+{
+  const int MAX_SPINS = 100;
+
+  for (int i = 0; i < MAX_SPINS; ++i)
+    {
+      if ((*ptr & mask) == 0)
+        return;
+
+      xrcu::xatomic_spin_nop ();
+    }
+
+  while (true)
+    {
+      uintptr_t val = *ptr;
+      if ((val & mask) == 0)
+        return;
+      else if ((val & RW_SLEEP) || xrcu::xatomic_cas_bool (ptr, val,
+                                                           val | RW_SLEEP))
+        syscall (SYS_futex, futex_ptr<sizeof (int) < sizeof (void *)> (ptr),
+                 (long)(FUTEX_WAIT | FUTEX_PRIVATE_FLAG),
+                 (long)(int)(val | RW_SLEEP), 0ul);
+    }
+}
+
+static inline void
+rw_wake (uintptr_t *ptr)
+{
+  if (xrcu::xatomic_and (ptr, ~RW_SLEEP) & RW_SLEEP)
+    syscall (SYS_futex, futex_ptr<sizeof (int) < sizeof (void *)> (ptr),
+             (long)(FUTEX_WAKE | FUTEX_PRIVATE_FLAG), (long)INT_MAX);
+}
+
 #else
 
 #include <thread>
-#include <atomic>
 
 static inline void
 lwlock_acquire (uintptr_t *ptr)
@@ -106,6 +189,41 @@ lwlock_release (uintptr_t *ptr)
   std::atomic_thread_fence (std::memory_order_release);
 }
 
+static inline void
+clh_wait (uintptr_t *ptr)
+{
+  const int MAX_SPINS = 1000;
+
+  for (int i = 0; *ptr != 0; ++i)
+    if (i < MAX_SPINS)
+      xrcu::xatomic_spin_nop ();
+    else
+      std::this_thread::yield ();
+}
+
+static inline void
+clh_wake (uintptr_t *ptr)
+{
+  xrcu::xatomic_swap (ptr, 0);
+}
+
+static void
+rw_wait (uintptr_t *ptr, uintptr_t mask)
+{
+  const int MAX_SPINS = 1000;
+
+  for (int i = 0; (*ptr & mask) != 0; ++i)
+    if (i < MAX_SPINS)
+      xrcu::xatomic_spin_nop ();
+    else
+      std::this_thread::yield ();
+}
+
+static inline void
+rw_wake (uintptr_t *)
+{
+}
+
 #endif
 
 namespace xrcu
@@ -121,4 +239,232 @@ void lwlock::release ()
   lwlock_release (&this->lock);
 }
 
+/* Nodes used by the queue-based lock. Each one has a cache line to itself,
+ * so that waiting on one doesn't interfere with the others. */
+struct alignas (64) clh_node
+{
+  uintptr_t state = 0;
+};
+
+/* A thread enqueues itself with its own node. Once the lock is acquired, the
+ * node belongs to the lock, and the thread takes over its predecessor's, which
+ * nobody else can reference at that point. As such, a thread only ever needs
+ * one of them, no matter how many locks it holds. */
+
+#if defined (__MINGW32__) || defined (__MINGW64__)
+
+// Mingw has problems with thread_local destructors.
+
+static void
+clh_key_fini (void *ptr)
+{
+  delete (clh_node *)ptr;
+}
+
+static pthread_key_t clh_key;
+static bool clh_key_valid = pthread_key_create (&clh_key, clh_key_fini) == 0;
+
+static clh_node*
+clh_get ()
+{
+  auto ret = clh_key_valid ?
+             (clh_node *)pthread_getspecific (clh_key) : nullptr;
+  return (ret ? ret : new clh_node ());
+}
+
+static void
+clh_set (clh_node *node)
+{
+  if (clh_key_valid)
+    pthread_setspecific (clh_key, node);
+}
+
+#else
+
+struct clh_cache
+{
+  clh_node *node;
+  bool armed;
+  // Set once the thread is exiting, so that nodes are no longer cached.
+  bool dead;
+};
+
+static XRCU_TLS clh_cache tl_clh;
+
+struct clh_guard
+{
+  clh_cache *cache = nullptr;
+
+  ~clh_guard ()
+    {
+      if (!this->cache)
+        return;
+
+      // Locks may still be taken from other thread_local destructors.
+      delete this->cache->node;
+      this->cache->node = nullptr;
+      this->cache->dead = true;
+    }
+};
+
+static thread_local clh_guard tl_clh_guard;
+
+static clh_node*
+clh_get ()
+{
+  auto ret = tl_clh.node;
+  return (ret ? ret : new clh_node ());
+}
+
+static void
+clh_set (clh_node *node)
+{
+  auto& self = tl_clh;
+  if (XRCU_UNLIKELY (self.dead))
+    {
+      delete node;
+      return;
+    }
+  else if (XRCU_UNLIKELY (!self.armed))
+    {
+      tl_clh_guard.cache = &self;
+      self.armed = true;
+    }
+
+  self.node = node;
+}
+
+#endif
+
+clh_lock::clh_lock () : tail ((uintptr_t)new clh_node ())
+{
+}
+
+clh_lock::~clh_lock ()
+{
+  delete (clh_node *)this->tail;
+}
+
+void clh_lock::acquire ()
+{
+  auto self = clh_get ();
+  self->state = 1;
+
+  auto pred = (clh_node *)xatomic_swap (&this->tail, (uintptr_t)self);
+  clh_wait (&pred->state);
+  std::atomic_thread_fence (std::memory_order_acquire);
+
+  this->owner = (uintptr_t)self;
+  clh_set (pred);
+}
+
+void clh_lock::release ()
+{
+  clh_wake (&((clh_node *)this->owner)->state);
+}
+
+rwlwlock::rwlwlock (bool rcu_biased) : state (rcu_biased ? RW_BIASED : 0)
+{
+}
+
+bool rwlwlock::acquire ()
+{
+  uintptr_t *ptr = &this->state;
+  uintptr_t val = *ptr;
+
+  if (val & RW_BIASED)
+    {
+      if (xrcu::in_cs ())
+        // We would be waiting for ourselves otherwise.
+        return (false);
+
+      // Exclude other writers, then wait for the readers to go away.
+      while (true)
+        {
+          val = *ptr;
+          if (!(val & RW_WRITER) &&
+              xatomic_cas_bool (ptr, val, val | RW_WRITER))
+            break;
+
+          rw_wait (ptr, RW_WRITER);
+        }
+
+      if (!xrcu::sync ())
+        { // Readers may still be around; don't claim the lock.
+          this->release ();
+          return (false);
+        }
+
+      return (true);
+    }
+  else if (!(val & ~RW_SLEEP) && xatomic_cas_bool (ptr, val, val | RW_WRITER))
+    return (true);
+
+  // Announce ourselves, so that new readers stay out.
+  xatomic_add (ptr, RW_WWAIT);
+  while (true)
+    {
+      val = *ptr;
+      if (!(val & (RW_WRITER | RW_READER_MASK)))
+        {
+          if (xatomic_cas_bool (ptr, val, (val - RW_WWAIT) | RW_WRITER))
+            return (true);
+        }
+      else
+        rw_wait (ptr, RW_WRITER | RW_READER_MASK);
+    }
+}
+
+void rwlwlock::lock ()
+{
+  if (!this->acquire ())
+    throw std::system_error (std::make_error_code
+      (std::errc::resource_deadlock_would_occur));
+}
+
+void rwlwlock::release ()
+{
+  if (xatomic_and (&this->state, ~RW_WRITER) & RW_SLEEP)
+    rw_wake (&this->state);
+}
+
+void rwlwlock::acquire_shared ()
+{
+  uintptr_t *ptr = &this->state;
+
+  while (true)
+    {
+      uintptr_t val = *ptr;
+      if (val & RW_BIASED)
+        {
+          enter_cs ();
+          /* If there's a writer, then it may have already started waiting
+           * for readers, so we must get out of the way. */
+          if (!(*ptr & RW_WRITER))
+            return;
+
+          exit_cs ();
+          rw_wait (ptr, RW_WRITER);
+        }
+      else if (!(val & (RW_WRITER | RW_WWAIT_MASK)))
+        {
+          if (xatomic_cas_bool (ptr, val, val + RW_READER))
+            return;
+        }
+      else
+        rw_wait (ptr, RW_WRITER | RW_WWAIT_MASK);
+    }
+}
+
+void rwlwlock::release_shared ()
+{
+  uintptr_t *ptr = &this->state;
+  if (*ptr & RW_BIASED)
+    exit_cs ();
+  else if ((xatomic_add (ptr, -(intptr_t)RW_READER) &
+            (RW_READER_MASK | RW_SLEEP)) == (RW_READER | RW_SLEEP))
+    // We were the last reader, and someone is waiting.
+    rw_wake (ptr);
+}
+
 } // namespace xrcu
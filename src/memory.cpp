@@ -0,0 +1,265 @@
+/* Definitions for memory-related interfaces.
+
+   This file is part of xrcu.
+
+   xrcu is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "xrcu/memory.hpp"
+#include "xrcu/xrcu.hpp"
+#include <atomic>
+#include <new>
+
+#if defined (__MINGW32__) || defined (__MINGW64__)
+  #include <pthread.h>
+#endif
+
+namespace xrcu
+{
+
+namespace detail
+{
+
+// Sizes of the blocks are rounded up to a multiple of this.
+static const size_t SLAB_GRAIN = 16;
+// Number of size classes. Larger blocks aren't cached.
+static const unsigned int SLAB_CLASSES = 32;
+// Number of blocks in a full magazine.
+static const unsigned int MAG_SIZE = 32;
+// Number of full magazines that are kept around for any thread to take.
+static const unsigned int DEPOT_SLOTS = 32;
+
+/*
+ * A magazine is a list of free blocks, linked through their first word. We
+ * keep track of the room that's left in it, so that a thread that has never
+ * cached anything takes the slow path when freeing.
+ */
+struct slab_mag
+{
+  void *head;
+  unsigned int room;
+};
+
+struct slab_cache
+{
+  slab_mag mags[SLAB_CLASSES];
+  // A full magazine for each class, used before going to the depot.
+  void *spare[SLAB_CLASSES];
+  bool armed;
+  bool dead;
+};
+
+static XRCU_TLS slab_cache tl_slab;
+
+// Full magazines that were released by threads, for each size class.
+static std::atomic<void *> slab_depot[SLAB_CLASSES][DEPOT_SLOTS];
+
+static inline size_t
+class_size (size_t cls)
+{
+  return ((cls + 1) * SLAB_GRAIN);
+}
+
+// Take the magazine that was released last, whose blocks are likely cached.
+static void*
+depot_get (size_t cls)
+{
+  for (unsigned int i = DEPOT_SLOTS; i-- > 0; )
+    {
+      auto& slot = slab_depot[cls][i];
+      if (slot.load (std::memory_order_relaxed))
+        {
+          void *ret = slot.exchange (nullptr, std::memory_order_acquire);
+          if (ret)
+            return (ret);
+        }
+    }
+
+  return (nullptr);
+}
+
+static void
+free_blocks (void *blk)
+{
+  while (blk)
+    {
+      void *next = *(void **)blk;
+      ::operator delete (blk);
+      blk = next;
+    }
+}
+
+// Hand off a full magazine, or release its blocks if the depot is full.
+static void
+depot_put (size_t cls, void *mag)
+{
+  for (auto& slot : slab_depot[cls])
+    {
+      void *exp = nullptr;
+      if (!slot.load (std::memory_order_relaxed) &&
+          slot.compare_exchange_strong (exp, mag, std::memory_order_release,
+                                        std::memory_order_relaxed))
+        return;
+    }
+
+  free_blocks (mag);
+}
+
+// Called when the thread exits, to release the blocks that it cached.
+static void
+slab_fini ()
+{
+  auto& self = tl_slab;
+  for (size_t cls = 0; cls < SLAB_CLASSES; ++cls)
+    {
+      auto& mag = self.mags[cls];
+      if (mag.head && !mag.room)
+        depot_put (cls, mag.head);
+      else
+        free_blocks (mag.head);
+
+      if (self.spare[cls])
+        depot_put (cls, self.spare[cls]);
+
+      // Make every later call go through the slow path.
+      mag.head = self.spare[cls] = nullptr;
+      mag.room = 0;
+    }
+
+  self.dead = true;
+}
+
+#if defined (__MINGW32__) || defined (__MINGW64__)
+
+// Mingw has problems with thread_local destructors.
+
+static void
+slab_key_fini (void *)
+{
+  slab_fini ();
+}
+
+static void
+slab_arm ()
+{
+  static pthread_key_t key;
+  static bool valid = pthread_key_create (&key, slab_key_fini) == 0;
+
+  if (valid)
+    pthread_setspecific (key, &tl_slab);
+}
+
+#else
+
+struct slab_guard
+{
+  slab_cache *cache = nullptr;
+
+  ~slab_guard ()
+    {
+      if (this->cache)
+        slab_fini ();
+    }
+};
+
+static thread_local slab_guard tl_slab_guard;
+
+static void
+slab_arm ()
+{
+  tl_slab_guard.cache = &tl_slab;
+}
+
+#endif
+
+// Make sure the thread's magazines are released once it exits.
+static inline void
+slab_prepare (slab_cache& self)
+{
+  if (XRCU_UNLIKELY (!self.armed))
+    {
+      slab_arm ();
+      self.armed = true;
+    }
+}
+
+void* slab_alloc (size_t size)
+{
+  size_t cls = (size - 1) / SLAB_GRAIN;
+  if (cls >= SLAB_CLASSES)
+    return (::operator new (size));
+
+  auto& self = tl_slab;
+  auto& mag = self.mags[cls];
+
+  if (XRCU_UNLIKELY (!mag.head))
+    {
+      void *blk = self.spare[cls];
+      if (blk)
+        self.spare[cls] = nullptr;
+      else if (self.dead || !(blk = depot_get (cls)))
+        return (::operator new (class_size (cls)));
+      else
+        slab_prepare (self);
+
+      mag.head = blk;
+      mag.room = 0;
+    }
+
+  void *ret = mag.head;
+  mag.head = *(void **)ret;
+  ++mag.room;
+  return (ret);
+}
+
+void slab_free (void *ptr, size_t size)
+{
+  size_t cls = (size - 1) / SLAB_GRAIN;
+  if (cls >= SLAB_CLASSES)
+    {
+      ::operator delete (ptr);
+      return;
+    }
+
+  auto& self = tl_slab;
+  auto& mag = self.mags[cls];
+
+  if (XRCU_UNLIKELY (!mag.room))
+    {
+      if (self.dead)
+        {
+          ::operator delete (ptr);
+          return;
+        }
+
+      slab_prepare (self);
+      if (mag.head)
+        { // The magazine is full; keep it as a spare.
+          if (self.spare[cls])
+            depot_put (cls, self.spare[cls]);
+
+          self.spare[cls] = mag.head;
+          mag.head = nullptr;
+        }
+
+      mag.room = MAG_SIZE;
+    }
+
+  *(void **)ptr = mag.head;
+  mag.head = ptr;
+  --mag.room;
+}
+
+} // namespace detail
+
+} // namespace xrcu
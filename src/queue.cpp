@@ -65,13 +65,6 @@ uintptr_t q_base::pop (uintptr_t xbit, uintptr_t dfl)
     }
 }
 
-void q_base::replace (std::atomic<q_base *>& ptr, q_base *old,
-                      q_base *nq, uintptr_t)
-{
-  finalize (old);
-  ptr.store (nq, std::memory_order_relaxed);
-}
-
 void q_base::clear (std::atomic<q_base *>&, q_base *old,
                     q_base *, uintptr_t empty)
 {
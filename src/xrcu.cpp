@@ -20,11 +20,14 @@
 #include "xrcu/version.hpp"
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <ctime>
 #include <functional>
+#include <new>
+#include <vector>
 
 #if defined (__MINGW32__) || defined (__MINGW64__)
   #include <pthread.h>
@@ -37,6 +40,82 @@ static void tl_set (void *);
 
 #endif
 
+#if defined (linux) || defined (__linux) || defined (__linux__)
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef FUTEX_PRIVATE_FLAG
+#  define FUTEX_PRIVATE_FLAG   0
+#endif
+
+static inline void
+futex_wait (std::atomic<int> *ptr, int val, long ns)
+{
+  struct timespec ts = { 0, ns };
+  syscall (SYS_futex, (int *)ptr, (long)(FUTEX_WAIT | FUTEX_PRIVATE_FLAG),
+           (long)val, &ts);
+}
+
+static inline void
+futex_wake (std::atomic<int> *ptr)
+{
+  syscall (SYS_futex, (int *)ptr,
+           (long)(FUTEX_WAKE | FUTEX_PRIVATE_FLAG), 1l);
+}
+
+#else
+
+static inline void
+futex_wait (std::atomic<int> *ptr, int val, long ns)
+{
+  if (ptr->load (std::memory_order_relaxed) == val)
+    std::this_thread::sleep_for (std::chrono::nanoseconds (ns));
+}
+
+static inline void
+futex_wake (std::atomic<int> *)
+{
+}
+
+#endif
+
+#if (defined (linux) || defined (__linux) || defined (__linux__)) &&   \
+    __has_include (<linux/membarrier.h>)
+
+#include <linux/membarrier.h>
+
+static bool
+memb_register ()
+{
+  long cmds = syscall (SYS_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+  return (cmds > 0 && (cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) != 0 &&
+          syscall (SYS_membarrier,
+                   MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0);
+}
+
+static inline void
+memb_fence ()
+{
+  syscall (SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+}
+
+#else
+
+static bool
+memb_register ()
+{
+  return (false);
+}
+
+static inline void
+memb_fence ()
+{
+}
+
+#endif
+
 namespace xrcu
 {
 
@@ -69,11 +148,6 @@ struct td_link
       return (this == this->next);
     }
 
-  bool linked_p () const
-    {
-      return (this->next != nullptr);
-    }
-
   void splice (td_link *dst)
     {
       if (this->empty_p ())
@@ -86,10 +160,8 @@ struct td_link
     }
 };
 
-static const uintptr_t GP_PHASE_BIT =
-  (uintptr_t)1 << (sizeof (uintptr_t) * 8 - 1);
-
-static const uintptr_t GP_NEST_MASK = GP_PHASE_BIT - 1;
+using detail::GP_PHASE_BIT;
+using detail::GP_NEST_MASK;
 
 // Possible states for a reader thread.
 enum
@@ -99,287 +171,1790 @@ enum
   rd_old
 };
 
-struct registry
+/*
+ * Grace period sequence numbers. The lowest bit is set while a grace period
+ * is in progress, and the rest count the number of completed ones.
+ */
+
+static inline uintptr_t
+gp_seq_snap (uintptr_t seq)
+{ // Value the sequence will have once a full grace period has elapsed.
+  return ((seq + 3) & ~(uintptr_t)1);
+}
+
+static inline bool
+gp_seq_done (uintptr_t seq, uintptr_t snap)
 {
-  std::atomic_uintptr_t counter;
-  td_link root;
-  std::mutex td_mtx;
-  std::mutex gp_mtx;
+  return ((intptr_t)(seq - snap) >= 0);
+}
 
-  static const unsigned int QS_ATTEMPTS = 1000;
+/*
+ * Runtime statistics. Every thread has its own set of counters, which are
+ * only written by it, and that are added up when they are read.
+ */
+enum
+{
+  ST_POLL_LOOPS,
+  ST_SLEEPS,
+  ST_FINALIZED,
+  ST_RECLAIMED,
+  ST_FLUSHES,
+  ST_DEFERRED,
+  ST_SYNC_HIST,
+  ST_NSTATS = ST_SYNC_HIST + rcu_stats::SYNC_BUCKETS
+};
+
+// These are always kept track of, since they are cheap to maintain.
+static std::atomic<uint64_t> g_grace_periods;
+
+// Stall detection settings.
+static std::atomic<stall_handler> g_stall_fn;
+static std::atomic<int64_t> g_stall_ns;
+
+#ifdef XRCU_STATS
+
+struct stats_block : public td_link
+{
+  std::atomic<uint64_t> vals[ST_NSTATS];
+
+  stats_block ();
+  ~stats_block ();
 
-  registry () : counter (1)
+  void bump (unsigned int ix, uint64_t n)
     {
-      this->root.init_head ();
+      this->vals[ix].store (this->vals[ix].load (std::memory_order_relaxed) +
+                            n, std::memory_order_relaxed);
     }
+};
 
-  void add_tdata (td_link *lp);
+struct stats_table
+{
+  std::mutex mtx;
+  td_link root;
+  // Values from the threads that have exited.
+  uint64_t retired[ST_NSTATS];
 
-  uintptr_t get_ctr () const
+  stats_table () : retired {}
     {
-      return (this->counter.load (std::memory_order_relaxed));
+      this->root.init_head ();
     }
+};
 
-  void poll_readers (td_link *, td_link *, td_link *);
+static stats_table&
+all_stats ()
+{
+  static stats_table ret;
+  return (ret);
+}
 
-  void sync ();
-};
+stats_block::stats_block () : vals {}
+{
+  auto& tab = all_stats ();
+  std::lock_guard<std::mutex> g (tab.mtx);
+  this->add (&tab.root);
+}
 
-static registry global_reg;
+stats_block::~stats_block ()
+{
+  auto& tab = all_stats ();
+  std::lock_guard<std::mutex> g (tab.mtx);
 
-// Maximum number of pending finalizers before flushing.
-#ifndef XRCU_MAX_FINS
-#  define XRCU_MAX_FINS   1000
-#endif
+  for (unsigned int i = 0; i < ST_NSTATS; ++i)
+    tab.retired[i] += this->vals[i].load (std::memory_order_relaxed);
 
-static const unsigned int MAX_FINS = XRCU_MAX_FINS;
+  this->del ();
+}
+
+static thread_local stats_block tl_stats;
 
-struct tl_data : public td_link
+static inline void
+stat_add (unsigned int ix, uint64_t n = 1)
 {
-  bool must_flush;
-  unsigned int n_fins;
-  std::atomic_uintptr_t counter;
-  size_t xrand_val;
-  finalizable *fin_objs;
-  finalizable **finpp;
+  tl_stats.bump (ix, n);
+}
 
-  void init ()
-    {
-      this->finpp = &this->fin_objs;
-    }
+#else
 
-  uintptr_t get_ctr () const
+static inline void
+stat_add (unsigned int, uint64_t = 1)
+{
+}
+
+#endif
+
+// Keeps track of the latency of a call to 'sync'.
+struct sync_timer
+{
+#ifdef XRCU_STATS
+  std::chrono::steady_clock::time_point start;
+
+  sync_timer () : start (std::chrono::steady_clock::now ())
     {
-      return (this->counter.load (std::memory_order_relaxed));
     }
 
-  int state () const
+  ~sync_timer ()
     {
-      auto val = this->counter.load (std::memory_order_acquire);
-      if (!(val & GP_NEST_MASK))
-        return (rd_inactive);
-      else if (!((val ^ global_reg.get_ctr ()) & GP_PHASE_BIT))
-        return (rd_active);
-      else
-        return (rd_old);
-    }
+      auto us = std::chrono::duration_cast<std::chrono::microseconds>
+                  (std::chrono::steady_clock::now () - this->start).count ();
+      unsigned int ix = 0;
 
-  bool in_cs () const
+      for (; us > 0 && ix < rcu_stats::SYNC_BUCKETS - 1; us >>= 1)
+        ++ix;
+
+      stat_add (ST_SYNC_HIST + ix);
+    }
+#else
+  sync_timer ()
     {
-      return ((this->get_ctr () & GP_NEST_MASK) != 0);
     }
+#endif
+};
 
-  bool flush_all ()
+// Number of per-CPU counters for sleepable domains.
+static unsigned int
+srcu_ncpus ()
+{
+#ifdef _SC_NPROCESSORS_CONF
+  /*
+   * Count the CPUs that are offline as well, so that each CPU has counters
+   * of its own, even if it's brought online later.
+   */
+  long n = sysconf (_SC_NPROCESSORS_CONF);
+  if (n > 0)
+    return ((unsigned int)n);
+#endif
+
+  unsigned int ret = std::thread::hardware_concurrency ();
+  return (ret ? ret : 1);
+}
+
+struct tl_data;
+
+struct registry : public detail::gp_state
+{
+  std::atomic_uintptr_t gp_seq;
+  td_link root;
+  std::mutex td_mtx;
+  // Readers that registered since the last grace period.
+  std::atomic<tl_data *> incoming;
+  // Objects left behind by exiting threads.
+  std::atomic<finalizable *> orphans;
+  std::atomic_uint n_orphans;
+  // Set when there are enough orphans that the next finalizer should flush.
+  std::atomic<bool> orphans_due;
+  // Number of readers that exited since the last time they were reaped.
+  std::atomic_uint n_dead;
+  std::timed_mutex gp_mtx;
+  // Whether readers rely on us to issue memory barriers on their behalf.
+  bool asym;
+  // Whether readers announce quiescent states instead of critical sections.
+  bool qsbr;
+  // Per-CPU reader counters, for sleepable domains.
+  detail::srcu_cpu *cpus = nullptr;
+  unsigned int ncpus = 0;
+  // Objects and grace periods pending for the reclaimer thread.
+  finalizable *rcl_head = nullptr;
+  finalizable **rcl_tailp = &rcl_head;
+  registry *rcl_next = nullptr;
+  bool rcl_queued = false;
+  bool rcl_gp_req = false;
+  // Number of exiting threads that are still using the registry.
+  unsigned int pins = 0;
+
+  static const unsigned int QS_ATTEMPTS = 1000;
+  // Number of exited readers after which we try to free them.
+  static const unsigned int REAP_THRESHOLD = 256;
+  // Upper bound for sleeps, in case a wakeup is missed.
+  static const long QS_SLEEP_NS = 1000000;
+
+  explicit registry (uintptr_t id = 0, bool qs = false, bool srcu = false) :
+      gp_seq (0), incoming (nullptr), orphans (nullptr), n_orphans (0),
+      orphans_due (false), n_dead (0), asym (!qs && !srcu && memb_register ()), qsbr (qs)
     {
-      if (!sync ())
-        return (false);
+      this->counter.store (1, std::memory_order_relaxed);
+      this->waiting.store (0, std::memory_order_relaxed);
+      this->slot = 0;
+      this->id = id;
+      this->root.init_head ();
 
-      for (auto f = this->fin_objs; f != nullptr; )
+      if (srcu)
         {
-          auto next = f->_Fin_next;
-          f->safe_destroy ();
-          f = next;
+          this->ncpus = srcu_ncpus ();
+          this->cpus = new detail::srcu_cpu[this->ncpus] ();
         }
+    }
 
-      this->fin_objs = nullptr;
-      this->init ();
-      this->n_fins = 0;
-      this->must_flush = false;
-      return (true);
+  ~registry ()
+    {
+      delete[] this->cpus;
     }
 
-  void finalize (finalizable *finp)
+  void wake_writer ()
     {
-      *this->finpp = finp;
-      this->finpp = &finp->_Fin_next;
+      if (this->waiting.exchange (0, std::memory_order_acq_rel))
+        futex_wake (&this->waiting);
+    }
 
-      if (++this->n_fins < MAX_FINS)
-        ;
-      else if (!this->flush_all ())
-        /*
-         * Couldn't reclaim memory since we are in a critical section.
-         * Set the flag to do it ASAP.
-         */
-        this->must_flush = true;
+  uintptr_t gp_snap () const
+    {
+      // Make sure any prior update is ordered before the snapshot.
+      std::atomic_thread_fence (std::memory_order_seq_cst);
+      return (gp_seq_snap (this->gp_seq.load (std::memory_order_relaxed)));
     }
 
-  ~tl_data ()
+  void add_tdata (tl_data *self);
+  void adopt ();
+  void reap ();
+  void add_orphans (finalizable *first, finalizable **lastp, unsigned int n);
+
+  uintptr_t get_ctr () const
     {
-      if (!this->linked_p ())
-        return;
+      return (this->counter.load (std::memory_order_relaxed));
+    }
 
-      this->counter.store (0, std::memory_order_release);
+  bool gp_done (uintptr_t snap) const
+    {
+      return (gp_seq_done (this->gp_seq.load (std::memory_order_acquire),
+                           snap));
+    }
 
-      if (this->n_fins > 0)
-        this->flush_all ();
+  typedef std::chrono::steady_clock::time_point time_point;
+
+  /*
+   * When stall detection is enabled, the time since which every reader
+   * that's being waited for has been in its critical section.
+   */
+  time_point stall_ref;
 
-      global_reg.td_mtx.lock ();
-      this->del ();
-      global_reg.td_mtx.unlock ();
+  void arm_wakeup ()
+    { // Ask the readers to wake us up once they exit.
+      this->waiting.store (1, std::memory_order_relaxed);
+      std::atomic_thread_fence (std::memory_order_seq_cst);
+      if (this->asym)
+        memb_fence ();
     }
-};
 
-void registry::add_tdata (td_link *lp)
-{
-  tl_set (lp);
-  this->td_mtx.lock ();
-  lp->add (&this->root);
-  ((tl_data *)lp)->init ();
-  this->td_mtx.unlock ();
-}
+  bool pause (bool sleep_p, const time_point *dlp);
+  void check_stalls (td_link *readers);
 
-#if defined (__MINGW32__) || defined (__MINGW64__)
+  bool poll_readers (td_link *, td_link *, td_link *,
+                     const time_point *dlp = nullptr);
 
-// Mingw has problems with thread_local destructors.
+  bool srcu_idle (unsigned int idx) const;
+  bool srcu_wait (unsigned int idx, const time_point *dlp);
 
-struct key_handler
-{
-  pthread_key_t key;
+  bool sync (uintptr_t snap, const time_point *dlp = nullptr);
+  bool end_gp (uintptr_t seq, bool ret, finalizable *orphs);
 
-  static void fini (void *ptr)
+  void sync ()
     {
-      ((tl_data *)ptr)->~tl_data ();
+      this->sync (this->gp_snap ());
     }
+};
 
-  key_handler ()
+// The registry for the global domain always has the first slot.
+static registry global_reg (1);
+
+// Table of live registries, indexed by slot.
+struct dom_table
+{
+  std::mutex mtx;
+  // Signaled when a registry is no longer pinned.
+  std::condition_variable cv;
+  std::vector<registry *> regs;
+  uintptr_t last_id;
+
+  dom_table () : regs (1, &global_reg), last_id (1)
     {
-      if (pthread_key_create (&this->key, key_handler::fini) != 0)
-        throw "failed to create thread key";
     }
 
-  void set (void *ptr)
+  void add (registry *reg)
     {
-      pthread_setspecific (this->key, ptr);
+      std::lock_guard<std::mutex> g (this->mtx);
+      size_t ix = 1;
+
+      while (ix < this->regs.size () && this->regs[ix])
+        ++ix;
+
+      if (ix == this->regs.size ())
+        this->regs.push_back (reg);
+      else
+        this->regs[ix] = reg;
+
+      reg->slot = (unsigned int)ix;
+      reg->id = ++this->last_id;
     }
 };
 
-struct alignas (alignof (tl_data)) tl_buf
+// Created on first use, since domains may be static objects elsewhere.
+static dom_table&
+domains ()
 {
-  unsigned char data[sizeof (tl_data)];
-};
-
-static thread_local tl_buf tlbuf;
-
-#define tldata   (*(tl_data *)&tlbuf)
+  static dom_table ret;
+  return (ret);
+}
 
-#else
+// Maximum number of pending finalizers before flushing.
+#ifndef XRCU_MAX_FINS
+#  define XRCU_MAX_FINS   1000
+#endif
 
-static thread_local tl_data tldata {};
+static const unsigned int MAX_FINS = XRCU_MAX_FINS;
 
+// Maximum number of bytes held by pending finalizers before flushing.
+#ifndef XRCU_MAX_FIN_BYTES
+#  define XRCU_MAX_FIN_BYTES   (1 << 20)
 #endif
 
-static inline tl_data*
-local_data ()
-{
-  auto self = &tldata;
-  if (!self->linked_p ())
-    global_reg.add_tdata (self);
+static const size_t MAX_FIN_BYTES = XRCU_MAX_FIN_BYTES;
 
-  return (self);
-}
+/*
+ * Bytes held by pending finalizers in every thread. Threads publish their
+ * own counts in increments of this size, to keep the counter uncontended.
+ */
+static const size_t PUB_BYTES = 16384;
+
+static std::atomic_size_t g_pending_bytes;
+static std::atomic_size_t g_mem_budget;
 
-void enter_cs ()
+static inline bool
+over_budget ()
 {
-  auto self = local_data ();
-  auto val = self->get_ctr ();
-  val = (val & GP_NEST_MASK) == 0 ? global_reg.get_ctr () : val + 1;
-  self->counter.store (val, std::memory_order_release);
+  size_t budget = g_mem_budget.load (std::memory_order_relaxed);
+  return (budget != 0 &&
+          g_pending_bytes.load (std::memory_order_relaxed) > budget);
 }
 
-void exit_cs ()
+// Destroy a list of finalizers, whose sizes have been published.
+static void
+destroy_fins (finalizable *f)
 {
-  auto self = local_data ();
-  auto val = self->get_ctr ();
-  self->counter.store (val - 1, std::memory_order_release);
+  size_t nbytes = 0, nfins = 0;
+  while (f != nullptr)
+    {
+      auto next = f->_Fin_next;
+      nbytes += f->fin_size ();
+      f->safe_destroy ();
+      f = next;
+      ++nfins;
+    }
 
-  if (self->must_flush && !self->in_cs ())
-    self->flush_all ();
-}
+  if (nbytes)
+    g_pending_bytes.fetch_sub (nbytes, std::memory_order_relaxed);
 
-bool in_cs ()
-{
-  auto self = &tldata;
-  return (self->linked_p () && self->in_cs ());
+  stat_add (ST_RECLAIMED, nfins);
 }
 
-void registry::poll_readers (td_link *readers, td_link *outp, td_link *qsp)
+// Background reclamation of finalizable objects.
+struct reclaimer
 {
-  for (unsigned int loops = 0 ; ; ++loops)
+  std::mutex mtx;
+  std::condition_variable cv;
+  // Signaled when the thread is done with a registry.
+  std::condition_variable idle;
+  std::thread thr;
+  // Registries with pending work, and the one being processed.
+  registry *pending = nullptr;
+  registry **ptailp = &pending;
+  registry *busy = nullptr;
+  std::atomic<bool> enabled { false };
+  bool running = false;
+  bool stopping = false;
+
+  bool active () const
     {
-      td_link *next, *runp = readers->next;
-      for (; runp != readers; runp = next)
-        {
-          next = runp->next;
-          switch (((tl_data *)runp)->state ())
-            {
-              case rd_active:
-                if (outp != nullptr)
-                  {
-                    runp->del ();
-                    runp->add (outp);
-                    break;
-                  }
+      return (this->enabled.load (std::memory_order_relaxed));
+    }
 
-              // Fallthrough.
-              case rd_inactive:
-                runp->del ();
-                runp->add (qsp);
-                break;
+  void run ();
 
-              default:
-                break;
-            }
+  void enqueue (registry *reg)
+    {
+      if (!reg->rcl_queued)
+        {
+          reg->rcl_next = nullptr;
+          *this->ptailp = reg;
+          this->ptailp = &reg->rcl_next;
+          reg->rcl_queued = true;
         }
 
-      if (readers->empty_p ())
-        break;
+      if (!this->running)
+        { // Lazily start the reclaimer thread.
+          this->thr = std::thread (&reclaimer::run, this);
+          this->running = true;
+        }
 
-      this->td_mtx.unlock ();
-      if (loops < QS_ATTEMPTS)
-        xatomic_spin_nop ();
-      else
-        std::this_thread::sleep_for (std::chrono::milliseconds (1));
-      this->td_mtx.lock ();
+      this->cv.notify_one ();
     }
-}
 
-void registry::sync ()
-{
-  this->gp_mtx.lock ();
-  this->td_mtx.lock ();
+  registry* dequeue ()
+    {
+      auto ret = this->pending;
+      if (ret)
+        {
+          this->pending = ret->rcl_next;
+          if (!this->pending)
+            this->ptailp = &this->pending;
+
+          ret->rcl_queued = false;
+        }
 
-  if (this->root.empty_p ())
+      return (ret);
+    }
+
+  static finalizable* take (registry *reg)
     {
-      this->td_mtx.unlock ();
-      this->gp_mtx.unlock ();
-      return;
+      auto ret = reg->rcl_head;
+      reg->rcl_head = nullptr;
+      reg->rcl_tailp = &reg->rcl_head;
+      reg->rcl_gp_req = false;
+      return (ret);
     }
 
-  td_link out, qs;
-  qs.init_head ();
-  out.init_head ();
+  void push (registry *reg, finalizable *first, finalizable **lastp)
+    {
+      std::lock_guard<std::mutex> g (this->mtx);
+      *reg->rcl_tailp = first;
+      reg->rcl_tailp = lastp;
+      this->enqueue (reg);
+    }
 
-  std::atomic_thread_fence (std::memory_order_acq_rel);
-  poll_readers (&this->root, &out, &qs);
+  void request_gp (registry *reg)
+    {
+      std::lock_guard<std::mutex> g (this->mtx);
+      if (!reg->rcl_gp_req)
+        {
+          reg->rcl_gp_req = true;
+          this->enqueue (reg);
+        }
+    }
 
-  this->counter.store (this->get_ctr () ^ GP_PHASE_BIT,
-                       std::memory_order_relaxed);
+  // Forget about REG, returning its pending objects.
+  finalizable* drain (registry *reg)
+    {
+      std::unique_lock<std::mutex> g (this->mtx);
+      if (reg->rcl_queued)
+        {
+          auto pp = &this->pending;
+          while (*pp != reg)
+            pp = &(*pp)->rcl_next;
 
-  poll_readers (&out, nullptr, &qs);
-  qs.splice (&this->root);
-  this->td_mtx.unlock ();
-  this->gp_mtx.unlock ();
-}
+          *pp = reg->rcl_next;
+          if (this->ptailp == &reg->rcl_next)
+            this->ptailp = pp;
 
-bool sync ()
-{
-  if (in_cs ())
-    return (false);
+          reg->rcl_queued = false;
+        }
+
+      while (this->busy == reg)
+        this->idle.wait (g);
+
+      return (take (reg));
+    }
+
+  void stop ()
+    {
+      std::unique_lock<std::mutex> g (this->mtx);
+      if (!this->running)
+        return;
+
+      this->stopping = true;
+      this->cv.notify_one ();
+      g.unlock ();
+
+      // The thread drains every pending batch before exiting.
+      this->thr.join ();
+      g.lock ();
+      this->running = this->stopping = false;
+
+      // Reclaim whatever was pushed after the thread was done.
+      for (registry *reg; (reg = this->dequeue ()) != nullptr; )
+        {
+          auto objs = take (reg);
+          g.unlock ();
+
+          if (objs)
+            {
+              reg->sync ();
+              destroy_fins (objs);
+            }
+
+          g.lock ();
+        }
+    }
+
+  ~reclaimer ()
+    {
+      this->stop ();
+    }
+};
+
+static reclaimer global_rcl;
+
+// A block of deferred callbacks, reclaimed as a whole.
+struct cb_block : public finalizable
+{
+  static const unsigned int NSLOTS = 32;
+
+  unsigned int used = 0;
+  detail::cb_slot slots[NSLOTS];
+
+  bool full_p () const
+    {
+      return (this->used == NSLOTS);
+    }
+
+  void safe_destroy ()
+    {
+      for (unsigned int i = 0; i < this->used; ++i)
+        // The slot is empty if storing the callback threw.
+        if (this->slots[i].fn)
+          this->slots[i].fn (this->slots[i].buf);
+
+      ::delete this;
+    }
+
+  size_t fin_size () const
+    {
+      return (sizeof (*this));
+    }
+};
+
+// A group of objects of the same type, destroyed with a single call.
+struct fin_group : public finalizable
+{
+  static const unsigned int NOBJS = 62;
+
+  batch_fn fn;
+  unsigned int used = 0;
+  // Bytes held by the objects in the group.
+  size_t nbytes = 0;
+  finalizable *objs[NOBJS];
+
+  explicit fin_group (batch_fn f) : fn (f)
+    {
+    }
+
+  bool full_p () const
+    {
+      return (this->used == NOBJS);
+    }
+
+  void safe_destroy ()
+    {
+      this->fn (this->objs, this->used);
+      // The group itself was already counted as one of them.
+      stat_add (ST_RECLAIMED, this->used - 1);
+      ::delete this;
+    }
+
+  size_t fin_size () const
+    {
+      return (sizeof (*this) + this->nbytes);
+    }
+};
+
+struct tl_data : public td_link, public detail::tl_reader
+{
+  unsigned int n_fins;
+  // Bytes held by pending finalizers, and how many of them are published.
+  size_t n_bytes;
+  size_t pub_bytes;
+  finalizable *fin_objs;
+  finalizable **finpp;
+  // Block for deferred callbacks, which is also in the list above.
+  cb_block *cbs;
+  // Groups that objects are being added to, which are in the list as well.
+  static const unsigned int NGROUPS = 4;
+  fin_group *groups[NGROUPS];
+  // Link for the registry's list of incoming readers.
+  tl_data *reg_next;
+  // Owning thread, and last grace period it was reported as stalling.
+  std::thread::id tid;
+  uintptr_t stall_seq;
+  // Set once the owning thread is done with us.
+  std::atomic<bool> dead;
+
+  void init ()
+    {
+      this->finpp = &this->fin_objs;
+    }
+
+  registry* reg () const
+    {
+      return ((registry *)this->gp);
+    }
+
+  uintptr_t get_ctr () const
+    {
+      return (this->counter.load (std::memory_order_relaxed));
+    }
+
+  int state () const
+    {
+      auto val = this->counter.load (std::memory_order_acquire);
+      if (this->reg ()->qsbr)
+        // Offline, or seen the current counter.
+        return (val == 0 || val == this->reg ()->get_ctr () ?
+                rd_inactive : rd_old);
+      else if (!(val & GP_NEST_MASK))
+        return (rd_inactive);
+      else if (!((val ^ this->reg ()->get_ctr ()) & GP_PHASE_BIT))
+        return (rd_active);
+      else
+        return (rd_old);
+    }
+
+  bool in_cs () const
+    {
+      return (!this->reg ()->qsbr &&
+              (this->get_ctr () & GP_NEST_MASK) != 0);
+    }
+
+  // Test if we hold references in a QSBR domain.
+  bool online_p () const
+    {
+      return (this->reg ()->qsbr && this->get_ctr () != 0);
+    }
+
+  void online ()
+    {
+      this->counter.store (this->reg ()->get_ctr (), std::memory_order_relaxed);
+      std::atomic_thread_fence (std::memory_order_seq_cst);
+    }
+
+  void offline ()
+    {
+      this->counter.store (0, std::memory_order_release);
+      this->reg ()->wake_writer ();
+    }
+
+  bool wait_gp (uintptr_t snap,
+                const registry::time_point *dlp = nullptr)
+    {
+      if (!this->online_p ())
+        return (this->reg ()->sync (snap, dlp));
+
+      // We would be waiting for ourselves otherwise.
+      this->offline ();
+      bool ret = this->reg ()->sync (snap, dlp);
+      this->online ();
+      return (ret);
+    }
+
+  bool flush_all ()
+    {
+      if (this->in_cs ())
+        return (false);
+
+      this->wait_gp (this->reg ()->gp_snap ());
+      this->publish ();
+
+      /*
+       * Detach the list before running the finalizers, so that whatever
+       * they defer goes into fresh blocks and groups, and waits for a
+       * grace period of its own.
+       */
+      auto objs = this->fin_objs;
+      this->reset ();
+      destroy_fins (objs);
+      stat_add (ST_FLUSHES);
+      return (true);
+    }
+
+  void defer_flush ()
+    { // Reclaim the pending objects as soon as possible.
+      this->must_flush = true;
+      if (this->reg ()->cpus)
+        detail::tl_srcu_flush = true;
+
+      stat_add (ST_DEFERRED);
+    }
+
+  // Test if we can wait for a grace period right now.
+  bool can_wait () const
+    {
+      if (this->reg ()->cpus)
+        // Sections exited by other threads make this err on the safe side.
+        return (detail::tl_srcu_depth == 0);
+
+      return (!this->in_cs () && !this->online_p ());
+    }
+
+  void reset ()
+    {
+      this->fin_objs = nullptr;
+      this->cbs = nullptr;
+      for (auto& grp : this->groups)
+        grp = nullptr;
+      this->init ();
+      this->n_fins = 0;
+      this->n_bytes = this->pub_bytes = 0;
+      this->must_flush = false;
+    }
+
+  void publish ()
+    {
+      if (this->n_bytes != this->pub_bytes)
+        {
+          g_pending_bytes.fetch_add (this->n_bytes - this->pub_bytes,
+                                     std::memory_order_relaxed);
+          this->pub_bytes = this->n_bytes;
+        }
+    }
+
+  void handoff ()
+    { // Pass the pending finalizers to the reclaimer thread.
+      this->publish ();
+      global_rcl.push (this->reg (), this->fin_objs, this->finpp);
+      this->reset ();
+      stat_add (ST_FLUSHES);
+    }
+
+  void append (finalizable *finp)
+    {
+      *this->finpp = finp;
+      this->finpp = &finp->_Fin_next;
+      this->add_bytes (finp->fin_size ());
+      stat_add (ST_FINALIZED);
+    }
+
+  void add_bytes (size_t nbytes)
+    {
+      this->n_bytes += nbytes;
+      if (this->n_bytes - this->pub_bytes >= PUB_BYTES)
+        this->publish ();
+    }
+
+  // Add FINP to the open group for objects that are destroyed by FN.
+  void group (finalizable *finp, finalizable::batch_fn fn)
+    {
+      auto gpp = &this->groups[((uintptr_t)fn >> 4) % NGROUPS];
+      for (auto& grp : this->groups)
+        if (!grp || grp->fn == fn)
+          {
+            gpp = &grp;
+            break;
+          }
+
+      auto grp = *gpp;
+      if (!grp || grp->fn != fn || grp->full_p ())
+        {
+          grp = new (std::nothrow) fin_group (fn);
+          if (!grp)
+            {
+              this->append (finp);
+              return;
+            }
+
+          // The new group counts as the first object.
+          *gpp = grp;
+          this->append (grp);
+        }
+      else
+        stat_add (ST_FINALIZED);
+
+      size_t nbytes = finp->fin_size ();
+      grp->objs[grp->used++] = finp;
+      grp->nbytes += nbytes;
+      this->add_bytes (nbytes);
+    }
+
+  detail::cb_slot* cb_alloc ()
+    {
+      if (!this->cbs || this->cbs->full_p ())
+        {
+          this->cbs = new cb_block ();
+          this->append (this->cbs);
+        }
+
+      auto ret = &this->cbs->slots[this->cbs->used++];
+      ret->fn = nullptr;
+      return (ret);
+    }
+
+  void finalize (finalizable *finp)
+    {
+      auto fn = finp->fin_batch ();
+      if (fn)
+        this->group (finp, fn);
+      else
+        this->append (finp);
+
+      this->added ();
+    }
+
+  // Reclaim the pending objects if there are too many of them.
+  void added ()
+    {
+      if (++this->n_fins < MAX_FINS && this->n_bytes < MAX_FIN_BYTES &&
+          !over_budget () &&
+          !this->reg ()->orphans_due.load (std::memory_order_relaxed))
+        ;
+      else if (over_budget () && this->can_wait ())
+        /*
+         * Too much memory is pending reclamation. Instead of adding to
+         * it, wait for a grace period and reclaim our objects right away.
+         */
+        this->flush_all ();
+      else if (over_budget () &&
+               (!this->reg ()->cpus ||
+                (this->n_fins < MAX_FINS && this->n_bytes < MAX_FIN_BYTES)))
+        /*
+         * Same as above, but we're in a critical section. Handing our
+         * objects off would only make the reclaimer thread pile them up
+         * behind the reader that's holding it back, so keep them, and
+         * wait once we're out. Threads may exit sleepable sections that
+         * other threads entered, so we fall back to a handoff in that
+         * case, rather than keeping objects forever.
+         */
+        this->defer_flush ();
+      else if (global_rcl.active () || this->reg ()->cpus)
+        /*
+         * The reclaimer thread waits for the grace period on our behalf,
+         * so this works even inside a critical section. This is always
+         * done for sleepable domains, since we can't tell if we're in one.
+         */
+        this->handoff ();
+      else if (this->online_p () || !this->flush_all ())
+        /*
+         * Couldn't reclaim memory since we are in a critical section, or
+         * because we may still hold references in a QSBR domain. Set the
+         * flag to do it ASAP.
+         */
+        this->defer_flush ();
+    }
+
+  /*
+   * Called when the owning thread is done with the registry. Since this
+   * happens for every exiting thread, we don't wait for a grace period
+   * here; pending objects are left for the next one instead. Afterwards,
+   * the reader may be freed by another thread at any time.
+   */
+  void fini ()
+    {
+      auto reg = this->reg ();
+      this->counter.store (0, std::memory_order_release);
+      reg->wake_writer ();
+
+      if (this->n_fins == 0)
+        ;
+      else if (global_rcl.active ())
+        this->handoff ();
+      else
+        {
+          this->publish ();
+          reg->add_orphans (this->fin_objs, this->finpp, this->n_fins);
+        }
+
+      this->dead.store (true, std::memory_order_release);
+      if (reg->n_dead.fetch_add (1, std::memory_order_relaxed) + 1 >=
+          registry::REAP_THRESHOLD && reg->td_mtx.try_lock ())
+        {
+          reg->reap ();
+          reg->td_mtx.unlock ();
+        }
+    }
+};
+
+// Move the incoming readers to the list. Called with the lock held.
+void registry::adopt ()
+{
+  auto self = this->incoming.exchange (nullptr, std::memory_order_acq_rel);
+  while (self != nullptr)
+    {
+      auto next = self->reg_next;
+      self->add (&this->root);
+      self = next;
+    }
+}
+
+// Free the readers whose threads have exited. Called with the lock held.
+void registry::reap ()
+{
+  this->adopt ();
+  this->n_dead.store (0, std::memory_order_relaxed);
+
+  for (td_link *next, *runp = this->root.next; runp != &this->root;
+      runp = next)
+    {
+      next = runp->next;
+      if (((tl_data *)runp)->dead.load (std::memory_order_acquire))
+        {
+          runp->del ();
+          delete (tl_data *)runp;
+        }
+    }
+}
+
+void registry::add_orphans (finalizable *first, finalizable **lastp,
+                            unsigned int n)
+{
+  auto head = this->orphans.load (std::memory_order_relaxed);
+  do
+    *lastp = head;
+  while (!this->orphans.compare_exchange_weak (head, first,
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_relaxed));
+
+  /*
+   * Nothing guarantees that a grace period will come any time soon, so
+   * once there are too many of them, ask the reclaimer thread for one if
+   * it's in use. Otherwise, have the next thread that finalizes anything
+   * flush, which reclaims them as well.
+   */
+  if (this->n_orphans.fetch_add (n, std::memory_order_relaxed) + n >=
+      MAX_FINS)
+    {
+      this->n_orphans.store (0, std::memory_order_relaxed);
+      if (global_rcl.active () || this->cpus)
+        global_rcl.request_gp (this);
+      else
+        this->orphans_due.store (true, std::memory_order_relaxed);
+    }
+}
+
+void reclaimer::run ()
+{
+  std::unique_lock<std::mutex> g (this->mtx);
+
+  while (true)
+    {
+      auto reg = this->dequeue ();
+      if (!reg)
+        {
+          if (this->stopping)
+            break;
+
+          this->cv.wait (g);
+          continue;
+        }
+
+      auto objs = take (reg);
+      this->busy = reg;
+      g.unlock ();
+
+      reg->sync ();
+      destroy_fins (objs);
+      g.lock ();
+      this->busy = nullptr;
+      this->idle.notify_all ();
+    }
+}
+
+// Install SELF as the calling thread's reader at slot IX.
+static void
+tl_slot_set (unsigned int ix, detail::tl_reader *self)
+{
+  if (ix >= detail::tl_nslots)
+    {
+      unsigned int n = detail::tl_nslots * 2;
+      if (n <= ix)
+        n = ix + 4;
+
+      auto slots = new detail::tl_reader* [n] ();
+      for (unsigned int i = 0; i < detail::tl_nslots; ++i)
+        slots[i] = detail::tl_slots[i];
+
+      delete[] detail::tl_slots;
+      detail::tl_slots = slots;
+      detail::tl_nslots = n;
+    }
+
+  detail::tl_slots[ix] = self;
+}
+
+// Release a reader for a domain other than the global one.
+static void
+release_reader (tl_data *self)
+{
+  auto& doms = domains ();
+  std::unique_lock<std::mutex> g (doms.mtx);
+  auto reg = self->reg ();
+
+  // Readers of destroyed domains have been unlinked already.
+  if (reg == nullptr)
+    {
+      g.unlock ();
+      delete self;
+      return;
+    }
+
+  ++reg->pins;
+  g.unlock ();
+  self->fini ();
+  g.lock ();
+
+  if (--reg->pins == 0)
+    doms.cv.notify_all ();
+}
+
+// Thread-specific state, which owns the readers for every domain.
+struct tl_state
+{
+  ~tl_state ()
+    {
+      // The global domain lives forever, so there's no need to pin it.
+      if (detail::tl_nslots && detail::tl_slots[0])
+        ((tl_data *)detail::tl_slots[0])->fini ();
+
+      for (unsigned int i = 1; i < detail::tl_nslots; ++i)
+        if (detail::tl_slots[i])
+          release_reader ((tl_data *)detail::tl_slots[i]);
+
+      delete[] detail::tl_slots;
+      detail::tl_self = nullptr;
+      detail::tl_slots = nullptr;
+      detail::tl_nslots = 0;
+    }
+};
+
+#if defined (__MINGW32__) || defined (__MINGW64__)
+
+// Mingw has problems with thread_local destructors.
+
+struct key_handler
+{
+  pthread_key_t key;
+
+  static void fini (void *ptr)
+    {
+      ((tl_state *)ptr)->~tl_state ();
+    }
+
+  key_handler ()
+    {
+      if (pthread_key_create (&this->key, key_handler::fini) != 0)
+        throw "failed to create thread key";
+    }
+
+  void set (void *ptr)
+    {
+      pthread_setspecific (this->key, ptr);
+    }
+};
+
+struct alignas (alignof (tl_state)) tl_buf
+{
+  unsigned char data[sizeof (tl_state)];
+};
+
+static thread_local tl_buf tlbuf;
+
+#define tldata   (*(tl_state *)&tlbuf)
+
+#else
+
+static thread_local tl_state tldata {};
+
+#endif
+
+void registry::add_tdata (tl_data *self)
+{
+  tl_set (&tldata);
+  self->gp = this;
+  self->id = this->id;
+  self->tid = std::this_thread::get_id ();
+  self->asym = this->asym;
+  self->init ();
+
+  /*
+   * Push ourselves without taking the lock; the next grace period will
+   * pick us up. Any critical section we enter after this point cannot
+   * hold references to anything removed before that grace period began.
+   */
+  auto head = this->incoming.load (std::memory_order_relaxed);
+  do
+    self->reg_next = head;
+  while (!this->incoming.compare_exchange_weak (head, self,
+                                                std::memory_order_acq_rel,
+                                                std::memory_order_relaxed));
+
+  tl_slot_set (this->slot, self);
+  if (this == &global_reg)
+    detail::tl_self = self;
+}
+
+static inline tl_data*
+local_data ()
+{
+  auto self = detail::tl_self;
+  if (XRCU_UNLIKELY (!self))
+    self = detail::tl_register (&global_reg);
+
+  return ((tl_data *)self);
+}
+
+namespace detail
+{
+
+XRCU_TLS tl_reader *tl_self;
+XRCU_TLS tl_reader **tl_slots;
+XRCU_TLS unsigned int tl_nslots;
+
+tl_reader* tl_register ()
+{
+  return (local_data ());
+}
+
+} // namespace detail
+
+static tl_data*
+add_reader (registry *reg)
+{
+  // Make sure the thread-specific state is destroyed at thread exit.
+  (void)&tldata;
+
+  auto ix = reg->slot;
+  if (ix < detail::tl_nslots && detail::tl_slots[ix])
+    { // Left over from a destroyed domain that had the same slot.
+      delete (tl_data *)detail::tl_slots[ix];
+      detail::tl_slots[ix] = nullptr;
+    }
+
+  auto self = new tl_data ();
+  reg->add_tdata (self);
+  return (self);
+}
+
+// Get the calling thread's reader for REG, registering it if needed.
+static inline tl_data*
+reader_data (registry *reg)
+{
+  auto self = detail::tl_lookup (reg);
+  if (XRCU_UNLIKELY (!self))
+    return (add_reader (reg));
+
+  return (static_cast<tl_data *> (self));
+}
+
+namespace detail
+{
+
+tl_reader* tl_register (gp_state *gp)
+{
+  return (add_reader ((registry *)gp));
+}
+
+void tl_exit (tl_reader *self)
+{
+  if (self->gp->waiting.load (std::memory_order_relaxed))
+    // A writer is waiting for us.
+    ((registry *)self->gp)->wake_writer ();
+
+  if (self->must_flush)
+    ((tl_data *)self)->flush_all ();
+}
+
+} // namespace detail
+
+void register_thread ()
+{
+  local_data ();
+}
+
+bool unregister_thread ()
+{
+  auto self = (tl_data *)detail::tl_self;
+  if (!self)
+    return (true);
+  else if (self->in_cs ())
+    return (false);
+
+  // Unlike thread exit, this reclaims the pending objects right away.
+  self->flush_all ();
+  self->fini ();
+  detail::tl_self = nullptr;
+  detail::tl_slots[0] = nullptr;
+  return (true);
+}
+
+bool registry::pause (bool sleep_p, const time_point *dlp)
+{
+  long ns = QS_SLEEP_NS;
+  if (dlp != nullptr)
+    {
+      auto left = std::chrono::duration_cast<std::chrono::nanoseconds>
+                    (*dlp - std::chrono::steady_clock::now ()).count ();
+
+      if (left <= 0)
+        return (false);
+      else if (left < ns)
+        ns = (long)left;
+    }
+
+  if (!sleep_p)
+    xatomic_spin_nop ();
+  else
+    {
+      stat_add (ST_SLEEPS);
+      futex_wait (&this->waiting, 1, ns);
+    }
+
+  return (true);
+}
+
+bool registry::poll_readers (td_link *readers, td_link *outp,
+                             td_link *qsp, const time_point *dlp)
+{
+  bool ret = true;
+
+  for (unsigned int loops = 0 ; ; ++loops)
+    {
+      stat_add (ST_POLL_LOOPS);
+      bool sleep_p = loops >= QS_ATTEMPTS;
+      if (sleep_p)
+        this->arm_wakeup ();
+
+      td_link *next, *runp = readers->next;
+      for (; runp != readers; runp = next)
+        {
+          next = runp->next;
+          if (((tl_data *)runp)->dead.load (std::memory_order_acquire))
+            { // The owning thread is gone.
+              runp->del ();
+              delete (tl_data *)runp;
+              continue;
+            }
+
+          switch (((tl_data *)runp)->state ())
+            {
+              case rd_active:
+                if (outp != nullptr)
+                  {
+                    runp->del ();
+                    runp->add (outp);
+                    break;
+                  }
+
+              // Fallthrough.
+              case rd_inactive:
+                runp->del ();
+                runp->add (qsp);
+                break;
+
+              default:
+                break;
+            }
+        }
+
+      if (readers->empty_p ())
+        break;
+      else if (sleep_p && g_stall_fn.load (std::memory_order_relaxed))
+        this->check_stalls (readers);
+
+      this->td_mtx.unlock ();
+      ret = this->pause (sleep_p, dlp);
+      this->td_mtx.lock ();
+
+      if (!ret)
+        break;
+    }
+
+  this->waiting.store (0, std::memory_order_relaxed);
+  return (ret);
+}
+
+void registry::check_stalls (td_link *readers)
+{
+  auto fn = g_stall_fn.load (std::memory_order_acquire);
+  auto elapsed = std::chrono::steady_clock::now () - this->stall_ref;
+
+  // Detection may have been enabled after the grace period started.
+  if (!fn || this->stall_ref == time_point::max () ||
+      elapsed < std::chrono::nanoseconds (g_stall_ns.load
+                                            (std::memory_order_relaxed)))
+    return;
+
+  // The readers that are left in the list are holding us up.
+  std::vector<std::thread::id> tids;
+  uintptr_t seq = this->gp_seq.load (std::memory_order_relaxed);
+
+  for (auto runp = readers->next; runp != readers; runp = runp->next)
+    {
+      auto self = (tl_data *)runp;
+      if (self->stall_seq != seq && self->state () == rd_old)
+        {
+          self->stall_seq = seq;
+          tids.push_back (self->tid);
+        }
+    }
+
+  if (tids.empty ())
+    return;
+
+  // Don't call the handler with the lock held.
+  this->td_mtx.unlock ();
+  for (auto tid : tids)
+    fn (tid, elapsed);
+
+  this->td_mtx.lock ();
+}
+
+bool registry::srcu_idle (unsigned int idx) const
+{
+  /*
+   * A reader increments the unlock counter after the lock one, so if we
+   * read the unlock counters first, we can't miss a lock that matches
+   * one of the unlocks we saw.
+   */
+  uintptr_t sum = 0;
+  for (unsigned int i = 0; i < this->ncpus; ++i)
+    sum += this->cpus[i].unlock[idx].load (std::memory_order_relaxed);
+
+  std::atomic_thread_fence (std::memory_order_seq_cst);
+  for (unsigned int i = 0; i < this->ncpus; ++i)
+    sum -= this->cpus[i].lock[idx].load (std::memory_order_relaxed);
+
+  std::atomic_thread_fence (std::memory_order_seq_cst);
+  return (sum == 0);
+}
+
+bool registry::srcu_wait (unsigned int idx, const time_point *dlp)
+{
+  bool ret = true;
+
+  for (unsigned int loops = 0 ; ; ++loops)
+    {
+      stat_add (ST_POLL_LOOPS);
+      bool sleep_p = loops >= QS_ATTEMPTS;
+      if (sleep_p)
+        this->arm_wakeup ();
+
+      if (this->srcu_idle (idx) || !(ret = this->pause (sleep_p, dlp)))
+        break;
+    }
+
+  this->waiting.store (0, std::memory_order_relaxed);
+  return (ret);
+}
+
+bool registry::sync (uintptr_t snap, const time_point *dlp)
+{
+  sync_timer tm;
+
+  if (!dlp)
+    this->gp_mtx.lock ();
+  else if (!this->gp_mtx.try_lock_until (*dlp))
+    return (false);
+
+  /*
+   * If a grace period started and completed while we were waiting for
+   * the lock, it also covers us, so there's no need to start another.
+   */
+  uintptr_t seq = this->gp_seq.load (std::memory_order_relaxed);
+  if (gp_seq_done (seq, snap))
+    {
+      this->gp_mtx.unlock ();
+      return (true);
+    }
+
+  this->gp_seq.store (seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence (std::memory_order_seq_cst);
+
+  // Objects left behind by exiting threads are covered by this grace period.
+  auto orphs = this->orphans.exchange (nullptr, std::memory_order_acq_rel);
+  if (orphs)
+    this->orphans_due.store (false, std::memory_order_relaxed);
+
+  bool ret = true;
+  if (this->cpus != nullptr)
+    {
+      /*
+       * Readers that fetched the other index before the last flip may
+       * still be around, so wait for them first. Then flip the index,
+       * and wait for the readers that were using it.
+       */
+      unsigned int idx = this->get_ctr () & 1;
+      ret = this->srcu_wait (idx ^ 1, dlp);
+
+      if (ret)
+        {
+          this->counter.store (this->get_ctr () + 1,
+                               std::memory_order_relaxed);
+          std::atomic_thread_fence (std::memory_order_seq_cst);
+          ret = this->srcu_wait (idx, dlp);
+        }
+
+      return (this->end_gp (seq, ret, orphs));
+    }
+
+  this->td_mtx.lock ();
+  this->adopt ();
+  this->n_dead.store (0, std::memory_order_relaxed);
+
+  /*
+   * Readers that are already stalling the first pass entered their critical
+   * section before we started. Those that stall the second pass, before we
+   * flip the phase.
+   */
+  bool stall_p = g_stall_fn.load (std::memory_order_relaxed) != nullptr;
+  this->stall_ref = stall_p ? std::chrono::steady_clock::now () :
+                              time_point::max ();
+
+  if (!this->root.empty_p ())
+    {
+      td_link out, qs;
+      qs.init_head ();
+      out.init_head ();
+
+      /*
+       * In asymmetric mode, readers only use compiler barriers, so we
+       * have to force a full memory barrier on every running thread
+       * before looking at their state and after we're done.
+       */
+      if (this->asym)
+        memb_fence ();
+
+      if (this->qsbr)
+        {
+          /*
+           * Readers copy the counter when they announce a quiescent state,
+           * so a single pass is enough. Zero is reserved for offline ones.
+           */
+          uintptr_t ctr = this->get_ctr () + 1;
+          this->counter.store (ctr ? ctr : 1, std::memory_order_relaxed);
+          std::atomic_thread_fence (std::memory_order_seq_cst);
+          ret = poll_readers (&this->root, nullptr, &qs, dlp);
+        }
+      else
+        {
+          ret = poll_readers (&this->root, &out, &qs, dlp);
+          if (ret)
+            {
+              if (stall_p)
+                this->stall_ref = std::chrono::steady_clock::now ();
+
+              this->counter.store (this->get_ctr () ^ GP_PHASE_BIT,
+                                   std::memory_order_relaxed);
+              ret = poll_readers (&out, nullptr, &qs, dlp);
+            }
+        }
+
+      /*
+       * If we timed out, simply put every reader back. Having flipped
+       * the phase is harmless; the next grace period will wait for
+       * readers in both phases anyway.
+       */
+      out.splice (&this->root);
+      qs.splice (&this->root);
+
+      if (this->asym)
+        memb_fence ();
+    }
+
+  this->td_mtx.unlock ();
+  return (this->end_gp (seq, ret, orphs));
+}
+
+bool registry::end_gp (uintptr_t seq, bool ret, finalizable *orphs)
+{
+  this->gp_seq.store (ret ? seq + 2 : seq, std::memory_order_release);
+  this->gp_mtx.unlock ();
+
+  if (ret)
+    g_grace_periods.fetch_add (1, std::memory_order_relaxed);
+
+  if (!orphs)
+    ;
+  else if (ret)
+    destroy_fins (orphs);
+  else
+    { // Leave them for the next grace period.
+      auto lastp = &orphs->_Fin_next;
+      while (*lastp)
+        lastp = &(*lastp)->_Fin_next;
+
+      this->add_orphans (orphs, lastp, 0);
+    }
+
+  return (ret);
+}
+
+namespace detail
+{
+
+domain_base::domain_base (unsigned int kind) :
+  gp (new registry (0, (kind & DOM_QSBR) != 0, (kind & DOM_SRCU) != 0))
+{
+  domains ().add ((registry *)this->gp);
+}
+
+domain_base::~domain_base ()
+{
+  auto reg = (registry *)this->gp;
+  if (reg == &global_reg)
+    return;
+
+  auto objs = global_rcl.drain (reg);
+  auto& doms = domains ();
+  std::unique_lock<std::mutex> g (doms.mtx);
+
+  // Wait for exiting threads to be done with the registry.
+  while (reg->pins != 0)
+    doms.cv.wait (g);
+
+  /*
+   * Collect the pending objects from the remaining readers, and mark
+   * them as dead. Their threads will free them later.
+   */
+  reg->adopt ();
+  for (td_link *next, *runp = reg->root.next; runp != &reg->root; runp = next)
+    {
+      auto self = (tl_data *)runp;
+      next = runp->next;
+
+      if (self->dead.load (std::memory_order_acquire))
+        {
+          delete self;
+          continue;
+        }
+      else if (self->fin_objs)
+        {
+          self->publish ();
+          *self->finpp = objs;
+          objs = self->fin_objs;
+        }
+
+      self->gp = nullptr;
+      self->next = self->prev = nullptr;
+    }
+
+  doms.regs[reg->slot] = nullptr;
+  g.unlock ();
+
+  auto orphs = reg->orphans.load (std::memory_order_relaxed);
+  if (orphs)
+    {
+      auto lastp = &orphs->_Fin_next;
+      while (*lastp)
+        lastp = &(*lastp)->_Fin_next;
+
+      *lastp = objs;
+      objs = orphs;
+    }
+
+  auto self = detail::tl_lookup (reg);
+  if (self)
+    { // We can free our own reader right away.
+      detail::tl_slots[reg->slot] = nullptr;
+      delete (tl_data *)self;
+    }
+
+  destroy_fins (objs);
+  delete reg;
+}
+
+void domain_base::register_thread ()
+{
+  this->reader ();
+}
+
+bool domain_base::unregister_thread ()
+{
+  if (this->gp == &global_reg)
+    return (xrcu::unregister_thread ());
+
+  auto self = (tl_data *)detail::tl_lookup (this->gp);
+  if (!self)
+    return (true);
+  else if (self->in_cs ())
+    return (false);
+
+  self->flush_all ();
+  self->fini ();
+  detail::tl_slots[this->gp->slot] = nullptr;
+  return (true);
+}
+
+bool domain_base::sync ()
+{
+  auto self = (tl_data *)tl_lookup (this->gp);
+  if (self && self->in_cs ())
+    return (false);
+  else if (self)
+    self->wait_gp (((registry *)this->gp)->gp_snap ());
+  else
+    ((registry *)this->gp)->sync ();
+
+  return (true);
+}
+
+bool domain_base::sync_for (std::chrono::nanoseconds timeout)
+{
+  auto self = (tl_data *)tl_lookup (this->gp);
+  if (self && self->in_cs ())
+    return (false);
+
+  auto reg = (registry *)this->gp;
+  auto dl = std::chrono::steady_clock::now () + timeout;
+  return (self ? self->wait_gp (reg->gp_snap (), &dl) :
+          reg->sync (reg->gp_snap (), &dl));
+}
+
+uintptr_t domain_base::get_state ()
+{
+  return (((registry *)this->gp)->gp_snap ());
+}
+
+uintptr_t domain_base::start_poll ()
+{
+  auto reg = (registry *)this->gp;
+  uintptr_t ret = reg->gp_snap ();
+
+  if (!reg->gp_done (ret))
+    global_rcl.request_gp (reg);
+
+  return (ret);
+}
+
+bool domain_base::poll_state (uintptr_t cookie)
+{
+  return (((registry *)this->gp)->gp_done (cookie));
+}
+
+bool domain_base::cond_sync (uintptr_t cookie)
+{
+  auto reg = (registry *)this->gp;
+  if (reg->gp_done (cookie))
+    return (true);
+
+  auto self = (tl_data *)tl_lookup (this->gp);
+  if (self && self->in_cs ())
+    return (false);
+  else if (self)
+    self->wait_gp (cookie);
+  else
+    reg->sync (cookie);
 
-  global_reg.sync ();
   return (true);
 }
 
+void domain_base::finalize (finalizable *finp)
+{
+  if (finp)
+    reader_data ((registry *)this->gp)->finalize (finp);
+}
+
+bool domain_base::flush_finalizers ()
+{
+  auto tld = reader_data ((registry *)this->gp);
+  bool ret = tld->flush_all ();
+
+  if (!ret)
+    tld->defer_flush ();
+
+  return (ret);
+}
+
+cb_slot* cb_alloc (tl_reader *self)
+{
+  return (((tl_data *)self)->cb_alloc ());
+}
+
+void cb_commit (tl_reader *self)
+{
+  ((tl_data *)self)->added ();
+}
+
+void finalize (tl_reader *self, finalizable *finp)
+{
+  ((tl_data *)self)->finalize (finp);
+}
+
+void finalize_async (gp_state *gp, finalizable *finp)
+{
+  auto reg = gp ? (registry *)gp : &global_reg;
+  stat_add (ST_FINALIZED);
+  global_rcl.push (reg, finp, &finp->_Fin_next);
+}
+
+XRCU_TLS uintptr_t tl_srcu_idx;
+XRCU_TLS intptr_t tl_srcu_depth;
+XRCU_TLS bool tl_srcu_flush;
+
+void srcu_flush ()
+{
+  tl_srcu_flush = false;
+  for (unsigned int i = 0; i < tl_nslots; ++i)
+    {
+      auto self = (tl_data *)tl_slots[i];
+      if (self && self->gp && self->must_flush && self->reg ()->cpus)
+        self->flush_all ();
+    }
+}
+
+void gp_wake (gp_state *gp)
+{
+  ((registry *)gp)->wake_writer ();
+}
+
+} // namespace detail
+
+rcu_domain& rcu_domain::global ()
+{
+  static rcu_domain ret (&global_reg);
+  return (ret);
+}
+
+srcu_domain::srcu_domain () : domain_base (DOM_SRCU)
+{
+  auto reg = (registry *)this->gp;
+  this->cpus = reg->cpus;
+  this->ncpus = reg->ncpus;
+}
+
+void qsbr_domain::register_thread ()
+{
+  auto self = reader_data ((registry *)this->gp);
+  if (!self->get_ctr ())
+    self->online ();
+}
+
+void qsbr_domain::thread_offline ()
+{
+  auto self = reader_data ((registry *)this->gp);
+  self->offline ();
+
+  if (self->must_flush)
+    self->flush_all ();
+}
+
+void qsbr_domain::thread_online ()
+{
+  reader_data ((registry *)this->gp)->online ();
+}
+
+bool sync ()
+{
+  return (rcu_domain::global().sync ());
+}
+
+bool sync_for (std::chrono::nanoseconds timeout)
+{
+  return (rcu_domain::global().sync_for (timeout));
+}
+
+uintptr_t get_state ()
+{
+  return (rcu_domain::global().get_state ());
+}
+
+uintptr_t start_poll ()
+{
+  return (rcu_domain::global().start_poll ());
+}
+
+bool poll_state (uintptr_t cookie)
+{
+  return (rcu_domain::global().poll_state (cookie));
+}
+
+bool cond_sync (uintptr_t cookie)
+{
+  return (rcu_domain::global().cond_sync (cookie));
+}
+
 void finalize (finalizable *finp)
 {
   if (finp)
@@ -392,52 +1967,233 @@ bool flush_finalizers ()
   bool ret = tld->flush_all ();
 
   if (!ret)
-    tld->must_flush = true;
+    tld->defer_flush ();
 
   return (ret);
 }
 
-unsigned int xrand ()
+// Test if the calling thread would hold up a grace period in any domain.
+static bool
+holds_refs ()
 {
-  auto self = &tldata;   // Avoid local_data ()
-  if (!self->xrand_val)
+  for (unsigned int i = 0; i < detail::tl_nslots; ++i)
     {
-      auto x1 = (unsigned int)(time (nullptr));
-      auto x2 = std::hash<std::thread::id> () (std::this_thread::get_id ());
-      self->xrand_val = x1 ^ x2;
+      auto self = (tl_data *)detail::tl_slots[i];
+      // Readers from destroyed domains have no registry.
+      if (self && self->gp && (self->in_cs () || self->online_p ()))
+        return (true);
     }
 
-  self->xrand_val = self->xrand_val * 1103515245 + 12345;
-  return (self->xrand_val >> 16);
+  return (false);
+}
+
+bool async_reclaim (bool enable)
+{
+  if (!enable && holds_refs ())
+    // The reclaimer thread may be waiting for us.
+    return (false);
+
+  bool ret = global_rcl.enabled.exchange (enable, std::memory_order_acq_rel);
+  if (ret && !enable)
+    global_rcl.stop ();
+
+  return (ret);
+}
+
+bool async_reclaim ()
+{
+  return (global_rcl.active ());
+}
+
+size_t memory_budget (size_t bytes)
+{
+  return (g_mem_budget.exchange (bytes, std::memory_order_relaxed));
+}
+
+size_t memory_budget ()
+{
+  return (g_mem_budget.load (std::memory_order_relaxed));
+}
+
+size_t pending_bytes ()
+{
+  return (g_pending_bytes.load (std::memory_order_relaxed));
+}
+
+void stall_detection (stall_handler fn, std::chrono::nanoseconds threshold)
+{
+  g_stall_ns.store (threshold.count (), std::memory_order_relaxed);
+  g_stall_fn.store (fn, std::memory_order_release);
+}
+
+rcu_stats stats ()
+{
+  rcu_stats ret {};
+  ret.grace_periods = g_grace_periods.load (std::memory_order_relaxed);
+  ret.pending_bytes = g_pending_bytes.load (std::memory_order_relaxed);
+
+#ifdef XRCU_STATS
+  uint64_t vals[ST_NSTATS];
+  auto& tab = all_stats ();
+
+  {
+    std::lock_guard<std::mutex> g (tab.mtx);
+    for (unsigned int i = 0; i < ST_NSTATS; ++i)
+      vals[i] = tab.retired[i];
+
+    for (auto runp = tab.root.next; runp != &tab.root; runp = runp->next)
+      for (unsigned int i = 0; i < ST_NSTATS; ++i)
+        vals[i] += ((stats_block *)runp)->vals[i].load
+          (std::memory_order_relaxed);
+  }
+
+  for (unsigned int i = 0; i < rcu_stats::SYNC_BUCKETS; ++i)
+    ret.sync_latency[i] = vals[ST_SYNC_HIST + i];
+
+  ret.poll_loops = vals[ST_POLL_LOOPS];
+  ret.sleeps = vals[ST_SLEEPS];
+  // The counters are read at slightly different times.
+  ret.pending_fins = vals[ST_FINALIZED] > vals[ST_RECLAIMED] ?
+                     vals[ST_FINALIZED] - vals[ST_RECLAIMED] : 0;
+  ret.flushes = vals[ST_FLUSHES];
+  ret.deferred_flushes = vals[ST_DEFERRED];
+#endif
+
+  return (ret);
+}
+
+// State for the per-thread generator. Zero means it hasn't been seeded.
+static XRCU_TLS uint64_t tl_rand_state;
+
+static uint64_t
+xrand_seed ()
+{
+  uint64_t x1 = (uint64_t)time (nullptr);
+  uint64_t x2 = std::hash<std::thread::id> () (std::this_thread::get_id ());
+  // Mix in the address of the state, which is different for every thread.
+  return ((x1 << 32) ^ x2 ^ (uintptr_t)&tl_rand_state);
+}
+
+/*
+ * This is wyrand: The state is a Weyl sequence, whose value is hashed with
+ * a single wide multiply. It passes the usual statistical tests, and every
+ * bit of the result is usable. When 128-bit integers aren't available, we
+ * fall back to the splitmix64 finalizer, which is only slightly slower.
+ */
+uint64_t xrand64 ()
+{
+  uint64_t s = tl_rand_state;
+  if (XRCU_UNLIKELY (!s))
+    s = xrand_seed ();
+
+  tl_rand_state = s += 0xa0761d6478bd642full;
+
+#ifdef __SIZEOF_INT128__
+  auto tmp = (unsigned __int128)s * (s ^ 0xe7037ed1a0b428dbull);
+  return ((uint64_t)(tmp >> 64) ^ (uint64_t)tmp);
+#else
+  s = (s ^ (s >> 30)) * 0xbf58476d1ce4e5b9ull;
+  s = (s ^ (s >> 27)) * 0x94d049bb133111ebull;
+  return (s ^ (s >> 31));
+#endif
+}
+
+unsigned int xrand ()
+{
+  return ((unsigned int)(xrand64 () >> 32));
 }
 
 static void
 atfork_prepare ()
 {
-  global_reg.gp_mtx.lock ();
-  global_reg.td_mtx.lock ();
+  auto& doms = domains ();
+#ifdef XRCU_STATS
+  all_stats().mtx.lock ();
+#endif
+  global_rcl.mtx.lock ();
+  doms.mtx.lock ();
+
+  for (auto reg : doms.regs)
+    if (reg)
+      {
+        reg->gp_mtx.lock ();
+        reg->td_mtx.lock ();
+      }
 }
 
 static void
 atfork_parent ()
 {
-  global_reg.td_mtx.unlock ();
-  global_reg.gp_mtx.unlock ();
+  auto& doms = domains ();
+  for (auto it = doms.regs.rbegin (); it != doms.regs.rend (); ++it)
+    if (*it)
+      {
+        (*it)->td_mtx.unlock ();
+        (*it)->gp_mtx.unlock ();
+      }
+
+  doms.mtx.unlock ();
+  global_rcl.mtx.unlock ();
+#ifdef XRCU_STATS
+  all_stats().mtx.unlock ();
+#endif
 }
 
 static void
 atfork_child ()
 {
-  atfork_parent ();
-  // Reset the registry
-  global_reg.root.init_head ();
+  /*
+   * The reclaimer thread doesn't exist in the child. Forget about it
+   * (without joining), and let the next handoff start a new one.
+   */
+  if (global_rcl.running)
+    {
+      new (&global_rcl.thr) std::thread ();
+      global_rcl.running = global_rcl.stopping = false;
+    }
 
-  auto self = &tldata;
-  if (!self->linked_p ())
-    return;
+  global_rcl.busy = nullptr;
+
+  // Registration for membarrier is not inherited by the child.
+  bool asym = global_reg.asym && memb_register ();
+
+  for (auto reg : domains ().regs)
+    {
+      if (!reg)
+        continue;
+
+      auto self = (tl_data *)detail::tl_lookup (reg);
+
+      /*
+       * The other threads are gone, so free their readers, including the
+       * ones that haven't been adopted yet.
+       */
+      reg->adopt ();
+      for (td_link *next, *runp = reg->root.next; runp != &reg->root;
+          runp = next)
+        {
+          next = runp->next;
+          if (runp != self)
+            delete (tl_data *)runp;
+        }
+
+      // Reset the registry
+      reg->root.init_head ();
+      reg->incoming.store (nullptr, std::memory_order_relaxed);
+      reg->n_dead.store (0, std::memory_order_relaxed);
+      reg->asym = reg->asym && asym;
+      reg->pins = 0;
+
+      if (!self)
+        continue;
 
-  // Manually add ourselves to the registry without locking.
-  self->add (&global_reg.root);
+      self->asym = reg->asym;
+
+      // Manually add ourselves to the registry without locking.
+      self->add (&reg->root);
+    }
+
+  atfork_parent ();
 }
 
 atfork atfork_data ()
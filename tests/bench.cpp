@@ -0,0 +1,728 @@
+/* Microbenchmarks entry point.
+
+   This file is part of xrcu.
+
+   xrcu is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "xrcu/xrcu.hpp"
+#include "xrcu/hash_table.hpp"
+#include "xrcu/lwlock.hpp"
+#include "xrcu/seqlock.hpp"
+#include "xrcu/skip_list.hpp"
+#include "xrcu/stack.hpp"
+#include "xrcu/utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+static volatile size_t bench_sink;
+
+template <typename Fn>
+static void
+report (const char *name, size_t nops, Fn fct)
+{
+  auto start = std::chrono::steady_clock::now ();
+  fct ();
+  auto end = std::chrono::steady_clock::now ();
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+              (end - start).count ();
+
+  printf ("%-36s %10.2f ns/op\n", name, (double)ns / nops);
+}
+
+static const size_t CS_LOOPS = 20000000;
+static const size_t LOOKUP_LOOPS = 5000000;
+static const int LOOKUP_KEYS = 1000;
+
+static void
+bench_cs ()
+{
+  report ("enter_cs/exit_cs", CS_LOOPS, [] ()
+    {
+      for (size_t i = 0; i < CS_LOOPS; ++i)
+        {
+          xrcu::enter_cs ();
+          xrcu::exit_cs ();
+        }
+    });
+
+  report ("nested cs_guard", CS_LOOPS, [] ()
+    {
+      xrcu::cs_guard outer;
+      for (size_t i = 0; i < CS_LOOPS; ++i)
+        xrcu::cs_guard g;
+    });
+}
+
+static xrcu::qsbr_domain bench_qsbr;
+
+static void
+bench_lookup ()
+{
+  xrcu::hash_table<int, int> ht;
+  xrcu::hash_table<int, int, std::equal_to<int>, std::hash<int>,
+                   std::allocator<std::pair<int, int>>,
+                   xrcu::qsbr_policy<bench_qsbr>> qht;
+  xrcu::hash_table<int, int, std::equal_to<int>, std::hash<int>,
+                   std::allocator<std::pair<int, int>>,
+                   xrcu::default_domain, xrcu::lwlock,
+                   xrcu::ht_pow2_policy> pht;
+  xrcu::skip_list<int> sl;
+
+  for (int i = 0; i < LOOKUP_KEYS; ++i)
+    {
+      ht.insert (i, i);
+      qht.insert (i, i);
+      pht.insert (i, i);
+      sl.insert (i);
+    }
+
+  report ("hash_table::find", LOOKUP_LOOPS, [&] ()
+    {
+      size_t ret = 0;
+      for (size_t i = 0; i < LOOKUP_LOOPS; ++i)
+        ret += ht.find ((int)(i % LOOKUP_KEYS), -1);
+
+      bench_sink = ret;
+    });
+
+  report ("hash_table::find (pow2)", LOOKUP_LOOPS, [&] ()
+    {
+      size_t ret = 0;
+      for (size_t i = 0; i < LOOKUP_LOOPS; ++i)
+        ret += pht.find ((int)(i % LOOKUP_KEYS), -1);
+
+      bench_sink = ret;
+    });
+
+  bench_qsbr.register_thread ();
+  report ("hash_table::find (QSBR)", LOOKUP_LOOPS, [&] ()
+    {
+      size_t ret = 0;
+      for (size_t i = 0; i < LOOKUP_LOOPS; ++i)
+        ret += qht.find ((int)(i % LOOKUP_KEYS), -1);
+
+      bench_sink = ret;
+    });
+
+  bench_qsbr.thread_offline ();
+
+  report ("skip_list::contains", LOOKUP_LOOPS, [&] ()
+    {
+      size_t ret = 0;
+      for (size_t i = 0; i < LOOKUP_LOOPS; ++i)
+        ret += sl.contains ((int)(i % LOOKUP_KEYS));
+
+      bench_sink = ret;
+    });
+}
+
+static const int BIG_KEYS = 1000000;
+
+template <typename Table>
+static void
+bench_big_lookup_with (const char *name)
+{
+  // Lookups of random keys in a table that doesn't fit in cache.
+  Table ht;
+  std::vector<int> keys (BIG_KEYS);
+
+  for (auto& key : keys)
+    {
+      key = (int)xrcu::xrand ();
+      ht.insert (key, key);
+    }
+
+  report (name, LOOKUP_LOOPS, [&] ()
+    {
+      size_t ret = 0;
+      for (size_t i = 0; i < LOOKUP_LOOPS; ++i)
+        ret += ht.find (keys[i * 7919 % BIG_KEYS], -1);
+
+      bench_sink = ret;
+    });
+}
+
+static void
+bench_sizing ()
+{
+  bench_big_lookup_with<xrcu::hash_table<int, int>>
+    ("hash_table::find, 1M keys (prime)");
+  bench_big_lookup_with<xrcu::hash_table<int, int, std::equal_to<int>,
+                                         std::hash<int>,
+                                         std::allocator<std::pair<int, int>>,
+                                         xrcu::default_domain, xrcu::lwlock,
+                                         xrcu::ht_pow2_policy>>
+    ("hash_table::find, 1M keys (pow2)");
+}
+
+static const size_t SYNC_LOOPS = 2000;
+
+static void
+bench_sync ()
+{
+  std::atomic<bool> started { false }, done { false };
+
+  // A reader that keeps entering short critical sections.
+  std::thread rd ([&] ()
+    {
+      while (!done.load (std::memory_order_relaxed))
+        {
+          xrcu::cs_guard g;
+          started.store (true, std::memory_order_relaxed);
+          auto end = std::chrono::steady_clock::now () +
+                     std::chrono::microseconds (20);
+          while (std::chrono::steady_clock::now () < end) ;
+        }
+    });
+
+  while (!started.load (std::memory_order_relaxed))
+    std::this_thread::yield ();
+
+  report ("sync with a busy reader", SYNC_LOOPS, [] ()
+    {
+      for (size_t i = 0; i < SYNC_LOOPS; ++i)
+        xrcu::sync ();
+    });
+
+  done.store (true);
+  rd.join ();
+}
+
+static xrcu::srcu_domain bench_srcu;
+
+static const size_t SCAN_LOOPS = 200;
+
+static void
+bench_scan ()
+{
+  /*
+   * Measure the cost of a grace period as the number of idle threads grows.
+   * Every thread has entered a critical section in both domains, so that
+   * the global domain has to visit all of them.
+   */
+  std::mutex mtx;
+  std::condition_variable cv;
+  size_t nready = 0;
+  bool done = false;
+  std::vector<std::thread> thrs;
+
+  for (size_t nthr : { 64, 1024, 10240 })
+    {
+      while (thrs.size () < nthr)
+        thrs.push_back (std::thread ([&] ()
+          {
+            xrcu::enter_cs ();
+            xrcu::exit_cs ();
+            bench_srcu.read_unlock (bench_srcu.read_lock ());
+
+            std::unique_lock<std::mutex> g (mtx);
+            ++nready;
+            cv.notify_all ();
+            while (!done)
+              cv.wait (g);
+          }));
+
+      {
+        std::unique_lock<std::mutex> g (mtx);
+        while (nready < nthr)
+          cv.wait (g);
+      }
+
+      char name[64];
+      snprintf (name, sizeof (name), "sync, %zu idle threads", nthr);
+      report (name, SCAN_LOOPS, [] ()
+        {
+          for (size_t i = 0; i < SCAN_LOOPS; ++i)
+            xrcu::sync ();
+        });
+
+      snprintf (name, sizeof (name), "sync (SRCU), %zu idle threads", nthr);
+      report (name, SCAN_LOOPS, [] ()
+        {
+          for (size_t i = 0; i < SCAN_LOOPS; ++i)
+            bench_srcu.sync ();
+        });
+    }
+
+  {
+    std::lock_guard<std::mutex> g (mtx);
+    done = true;
+    cv.notify_all ();
+  }
+
+  for (auto& thr : thrs)
+    thr.join ();
+}
+
+static const size_t CHURN_THREADS = 4000;
+static const size_t CHURN_BATCH = 8;
+
+static void
+bench_churn ()
+{
+  // Short-lived threads that register, retire an object and exit.
+  struct churn_obj : public xrcu::finalizable
+  {
+  };
+
+  std::atomic<bool> done { false };
+
+  // Meanwhile, another thread keeps entering long critical sections.
+  std::thread rd ([&] ()
+    {
+      while (!done.load (std::memory_order_relaxed))
+        {
+          xrcu::cs_guard g;
+          auto end = std::chrono::steady_clock::now () +
+                     std::chrono::microseconds (100);
+          while (std::chrono::steady_clock::now () < end) ;
+        }
+    });
+
+  report ("thread start/exit, busy reader", CHURN_THREADS, [] ()
+    {
+      for (size_t i = 0; i < CHURN_THREADS; i += CHURN_BATCH)
+        {
+          std::thread thrs[CHURN_BATCH];
+          for (auto& thr : thrs)
+            thr = std::thread ([] ()
+              {
+                xrcu::cs_guard g;
+                xrcu::finalize (new churn_obj ());
+              });
+
+          for (auto& thr : thrs)
+            thr.join ();
+        }
+    });
+
+  done.store (true);
+  rd.join ();
+  xrcu::sync ();
+}
+
+static const size_t RETIRE_LOOPS = 2000000;
+
+static void
+bench_retire ()
+{
+  // Retire a malloc'd buffer, either wrapped in a finalizable or not.
+  struct buf_fin : public xrcu::finalizable
+  {
+    void *ptr;
+
+    buf_fin (void *p) : ptr (p)
+      {
+      }
+
+    ~buf_fin ()
+      {
+        free (this->ptr);
+      }
+  };
+
+  report ("finalize (wrapped buffer)", RETIRE_LOOPS, [] ()
+    {
+      for (size_t i = 0; i < RETIRE_LOOPS; ++i)
+        xrcu::finalize (new buf_fin (malloc (32)));
+
+      xrcu::flush_finalizers ();
+    });
+
+  report ("defer (buffer)", RETIRE_LOOPS, [] ()
+    {
+      for (size_t i = 0; i < RETIRE_LOOPS; ++i)
+        {
+          void *ptr = malloc (32);
+          xrcu::defer ([ptr] () { free (ptr); });
+        }
+
+      xrcu::flush_finalizers ();
+    });
+
+  // Retire the values that containers wrap, as an update would.
+  typedef xrcu::detail::wrapped_traits<false, double,
+                                       std::allocator<double>> dbl_traits;
+  typedef xrcu::detail::wrapped_traits<false, std::vector<int>,
+                                       std::allocator<int>> vec_traits;
+
+  report ("retire wrapped double", RETIRE_LOOPS, [] ()
+    {
+      for (size_t i = 0; i < RETIRE_LOOPS; ++i)
+        dbl_traits::destroy (dbl_traits::make ((double)i));
+
+      xrcu::flush_finalizers ();
+    });
+
+  report ("retire wrapped vector", RETIRE_LOOPS, [] ()
+    {
+      for (size_t i = 0; i < RETIRE_LOOPS; ++i)
+        vec_traits::destroy (vec_traits::make (4, (int)i));
+
+      xrcu::flush_finalizers ();
+    });
+}
+
+static const size_t SLAB_LOOPS = 2000000;
+
+template <typename Table, typename Stack>
+static void
+bench_churn_with (const char *ht_name, const char *stk_name)
+{
+  Table ht;
+  Stack stk;
+
+  for (int i = 0; i < LOOKUP_KEYS; ++i)
+    ht.insert (i, 0.);
+
+  // Every update retires the previous value.
+  report (ht_name, SLAB_LOOPS, [&] ()
+    {
+      for (size_t i = 0; i < SLAB_LOOPS; ++i)
+        ht.insert ((int)(i % LOOKUP_KEYS), (double)i);
+
+      xrcu::flush_finalizers ();
+    });
+
+  report (stk_name, SLAB_LOOPS, [&] ()
+    {
+      for (size_t i = 0; i < SLAB_LOOPS; ++i)
+        {
+          stk.push ((int)i);
+          stk.pop ();
+        }
+
+      xrcu::flush_finalizers ();
+    });
+}
+
+static void
+bench_slab ()
+{
+  typedef std::pair<int, double> pair_type;
+
+  bench_churn_with<xrcu::hash_table<int, double>, xrcu::stack<int>>
+    ("hash_table update", "stack push/pop");
+
+  bench_churn_with<xrcu::hash_table<int, double, std::equal_to<int>,
+                                    std::hash<int>,
+                                    xrcu::rcu_slab<pair_type>>,
+                   xrcu::stack<int, xrcu::rcu_slab<int>>>
+    ("hash_table update (rcu_slab)", "stack push/pop (rcu_slab)");
+
+  // With a reclaimer thread, memory is freed by a different thread.
+  xrcu::async_reclaim (true);
+  bench_churn_with<xrcu::hash_table<int, double>, xrcu::stack<int>>
+    ("hash_table update, async", "stack push/pop, async");
+
+  bench_churn_with<xrcu::hash_table<int, double, std::equal_to<int>,
+                                    std::hash<int>,
+                                    xrcu::rcu_slab<pair_type>>,
+                   xrcu::stack<int, xrcu::rcu_slab<int>>>
+    ("hash_table update, async (rcu_slab)",
+     "stack push/pop, async (rcu_slab)");
+
+  xrcu::async_reclaim (false);
+}
+
+static const int LEVEL_KEYS = 1000000;
+
+static void
+bench_levels ()
+{
+  // Large lists, where the height of the towers matters.
+  for (double prob : { 0.125, 0.25, 0.5 })
+    {
+      xrcu::skip_list<int> sl { std::less<int> (), 32, prob };
+      char name[64];
+
+      snprintf (name, sizeof (name), "skip_list::insert, p = %g", prob);
+      report (name, LEVEL_KEYS, [&] ()
+        {
+          for (int i = 0; i < LEVEL_KEYS; ++i)
+            sl.insert ((int)(((unsigned int)i * 2654435761u) % LEVEL_KEYS));
+        });
+
+      snprintf (name, sizeof (name), "skip_list::contains, p = %g", prob);
+      report (name, LOOKUP_LOOPS, [&] ()
+        {
+          size_t ret = 0;
+          for (size_t i = 0; i < LOOKUP_LOOPS; ++i)
+            ret += sl.contains ((int)((i * 7919) % LEVEL_KEYS));
+
+          bench_sink = ret;
+        });
+    }
+}
+
+static const size_t LOCK_THREADS = 8;
+static const size_t LOCK_LOOPS = 200000;
+static const int LOCK_KEYS = 200000;
+
+template <typename Lock>
+static void
+bench_lock_with (const char *lk_name, const char *ht_name)
+{
+  // Every thread hammers the same lock with short critical sections.
+  Lock lk;
+  size_t counter = 0;
+
+  report (lk_name, LOCK_THREADS * LOCK_LOOPS, [&] ()
+    {
+      std::vector<std::thread> thrs;
+      for (size_t i = 0; i < LOCK_THREADS; ++i)
+        thrs.push_back (std::thread ([&] ()
+          {
+            for (size_t j = 0; j < LOCK_LOOPS; ++j)
+              {
+                lk.acquire ();
+                ++counter;
+                lk.release ();
+              }
+          }));
+
+      for (auto& thr : thrs)
+        thr.join ();
+    });
+
+  bench_sink = counter;
+
+  // Concurrent insertions into a growing table, which contend on rehashes.
+  report (ht_name, LOCK_KEYS, [] ()
+    {
+      xrcu::hash_table<int, int, std::equal_to<int>, std::hash<int>,
+                       std::allocator<std::pair<int, int>>,
+                       xrcu::default_domain, Lock> ht;
+      std::vector<std::thread> thrs;
+
+      for (size_t i = 0; i < LOCK_THREADS; ++i)
+        thrs.push_back (std::thread ([&ht] (int start)
+          {
+            for (int key = start; key < LOCK_KEYS; key += LOCK_THREADS)
+              ht.insert (key, key);
+          }, (int)i));
+
+      for (auto& thr : thrs)
+        thr.join ();
+    });
+}
+
+static const size_t RW_WRITE_EVERY = 1000;
+
+template <typename Lock>
+static void
+bench_rwlock_with (const char *name, Lock& lk)
+{
+  // Readers that take the lock in shared mode, with a rare writer.
+  report (name, LOCK_THREADS * LOCK_LOOPS, [&] ()
+    {
+      std::vector<std::thread> thrs;
+      for (size_t i = 0; i < LOCK_THREADS; ++i)
+        thrs.push_back (std::thread ([&lk] (size_t index)
+          {
+            for (size_t j = 0; j < LOCK_LOOPS; ++j)
+              if (index == 0 && j % RW_WRITE_EVERY == 0)
+                {
+                  lk.lock ();
+                  lk.unlock ();
+                }
+              else
+                {
+                  lk.lock_shared ();
+                  lk.unlock_shared ();
+                }
+          }, i));
+
+      for (auto& thr : thrs)
+        thr.join ();
+    });
+}
+
+static void
+bench_locks ()
+{
+  bench_lock_with<xrcu::lwlock> ("lwlock, contended",
+                                 "hash_table growth (lwlock)");
+  bench_lock_with<xrcu::clh_lock> ("clh_lock, contended",
+                                   "hash_table growth (clh_lock)");
+
+  std::shared_mutex smtx;
+  xrcu::rwlwlock rwl, brwl { true };
+
+  bench_rwlock_with ("std::shared_mutex, read-mostly", smtx);
+  bench_rwlock_with ("rwlwlock, read-mostly", rwl);
+  bench_rwlock_with ("rwlwlock (RCU-biased), read-mostly", brwl);
+}
+
+static const size_t SEQ_LOOPS = 5000000;
+
+struct bench_stamps
+{
+  uint64_t first, last;
+};
+
+template <typename Seq>
+static void
+bench_seqlock_with (const char *upd_name, const char *rd_name)
+{
+  Seq sq;
+
+  report (upd_name, SEQ_LOOPS, [&] ()
+    {
+      for (size_t i = 0; i < SEQ_LOOPS; ++i)
+        sq.store (bench_stamps { i, i + 1 });
+    });
+
+  report (rd_name, SEQ_LOOPS, [&] ()
+    {
+      size_t ret = 0;
+      for (size_t i = 0; i < SEQ_LOOPS; ++i)
+        ret += sq.load ().last;
+
+      bench_sink = ret;
+    });
+}
+
+static void
+bench_seqlock ()
+{
+  bench_seqlock_with<xrcu::seqlock<bench_stamps>>
+    ("seqlock::store", "seqlock::load");
+  bench_seqlock_with<xrcu::dcas_seqlock<bench_stamps>>
+    ("dcas_seqlock::store", "dcas_seqlock::load");
+
+  // The same, but with a pointer to a record that's replaced on updates.
+  struct stamps_fin : public bench_stamps, public xrcu::finalizable
+  {
+    stamps_fin (uint64_t f, uint64_t l) : bench_stamps { f, l }
+      {
+      }
+  };
+
+  std::atomic<stamps_fin *> ptr { new stamps_fin (0, 0) };
+
+  report ("RCU pointer update", SEQ_LOOPS, [&] ()
+    {
+      for (size_t i = 0; i < SEQ_LOOPS; ++i)
+        xrcu::finalize (ptr.exchange (new stamps_fin (i, i + 1),
+                                      std::memory_order_acq_rel));
+
+      xrcu::flush_finalizers ();
+    });
+
+  report ("RCU pointer read", SEQ_LOOPS, [&] ()
+    {
+      size_t ret = 0;
+      for (size_t i = 0; i < SEQ_LOOPS; ++i)
+        {
+          xrcu::cs_guard g;
+          ret += ptr.load (std::memory_order_acquire)->last;
+        }
+
+      bench_sink = ret;
+    });
+
+  delete ptr.load ();
+}
+
+static const int GROW_KEYS = 4000000;
+
+static void
+bench_grow ()
+{
+  // Insertions into a table that starts out empty, and the worst pause.
+  xrcu::hash_table<int, int> ht;
+  double max_pause = 0;
+
+  report ("hash_table insert, growing", GROW_KEYS, [&] ()
+    {
+      for (int key = 0; key < GROW_KEYS; ++key)
+        {
+          auto start = std::chrono::steady_clock::now ();
+          ht.insert (key, key);
+          std::chrono::duration<double, std::micro> elapsed =
+            std::chrono::steady_clock::now () - start;
+
+          if (elapsed.count () > max_pause)
+            max_pause = elapsed.count ();
+        }
+    });
+
+  printf ("%-36s %10.2f us\n", "hash_table insert, longest pause",
+          max_pause);
+  bench_sink = ht.size ();
+
+  // Insertions and erasures that keep the number of keys constant.
+  xrcu::hash_table<int, int> churn;
+
+  report ("hash_table insert/erase, same size", GROW_KEYS, [&] ()
+    {
+      for (int key = 0; key < GROW_KEYS; ++key)
+        {
+          churn.insert (key, key);
+          if (key >= LOOKUP_KEYS)
+            churn.erase (key - LOOKUP_KEYS);
+        }
+    });
+
+  printf ("%-36s %10zu\n", "hash_table insert/erase, entries",
+          churn.vec->entries);
+}
+
+struct bench_fn
+{
+  const char *name;
+  void (*fct) (void);
+};
+
+static const bench_fn benchmarks[] =
+{
+  { "cs", bench_cs },
+  { "lookup", bench_lookup },
+  { "sync", bench_sync },
+  { "scan", bench_scan },
+  { "churn", bench_churn },
+  { "retire", bench_retire },
+  { "slab", bench_slab },
+  { "levels", bench_levels },
+  { "locks", bench_locks },
+  { "seqlock", bench_seqlock },
+  { "grow", bench_grow },
+  { "sizing", bench_sizing },
+};
+
+int main (int argc, char **argv)
+{
+  // Run the benchmarks named in the command line, or all of them.
+  for (const auto& bench : benchmarks)
+    {
+      bool run = argc < 2;
+      for (int i = 1; i < argc && !run; ++i)
+        run = strcmp (argv[i], bench.name) == 0;
+
+      if (run)
+        bench.fct ();
+    }
+
+  return (0);
+}
@@ -306,6 +306,316 @@ void test_iter ()
   ASSERT (c >= 5);
 }
 
+typedef xrcu::hash_table<int, std::string, std::equal_to<int>,
+                         std::hash<int>, test_allocator<int>,
+                         xrcu::default_domain, xrcu::clh_lock> clh_table_t;
+
+static xrcu::clh_lock *CLH_LATE;
+
+struct clh_late_user
+{
+  ~clh_late_user ()
+    {
+      CLH_LATE->acquire ();
+      CLH_LATE->release ();
+    }
+};
+
+void test_queue_lock ()
+{
+  // Mutual exclusion, with threads holding more than a lock at once.
+  xrcu::clh_lock l1, l2;
+  size_t counter = 0;
+  std::vector<std::thread> thrs;
+
+  for (int i = 0; i < INSERTER_THREADS; ++i)
+    thrs.push_back (std::thread ([&] ()
+      {
+        for (int j = 0; j < INSERTER_LOOPS; ++j)
+          {
+            l1.acquire ();
+            if (j % 2)
+              {
+                l2.acquire ();
+                ++counter;
+                l2.release ();
+              }
+            else
+              ++counter;
+
+            l1.release ();
+          }
+      }));
+
+  for (auto& thr : thrs)
+    thr.join ();
+
+  ASSERT (counter == (size_t)INSERTER_THREADS * INSERTER_LOOPS);
+
+  // The lock can still be taken from thread_local destructors that run late.
+  CLH_LATE = &l1;
+  std::thread ([] ()
+    {
+      // Constructed before the thread's cached node, so destroyed after it.
+      static thread_local clh_late_user user;
+      (void)&user;
+      CLH_LATE->acquire ();
+      CLH_LATE->release ();
+    }).join ();
+
+  // Tables that use it must rehash correctly under contention.
+  clh_table_t tx;
+  thrs.clear ();
+
+  for (int i = 0; i < INSERTER_THREADS; ++i)
+    thrs.push_back (std::thread ([&tx] (int index)
+      {
+        for (int j = 0; j < INSERTER_LOOPS; ++j)
+          {
+            int key = index * INSERTER_LOOPS + j;
+            ASSERT (tx.insert (key, mkstr (key)));
+          }
+      }, i));
+
+  for (auto& thr : thrs)
+    thr.join ();
+
+  ASSERT (tx.size () == INSERTER_THREADS * INSERTER_LOOPS);
+  for (const auto& p : tx)
+    ASSERT (mkstr (p.first) == p.second);
+
+  clh_table_t t2 { { -1, "abc" } };
+  t2.swap (tx);
+  ASSERT (tx.size () == 1);
+  ASSERT (t2.size () == INSERTER_THREADS * INSERTER_LOOPS);
+}
+
+void test_migration ()
+{
+  table_t tx;
+  int nkeys = 0;
+
+  // Fill the table up until a migration starts.
+  while (!tx.vec->next.load ())
+    {
+      tx.insert (nkeys, mkstr (nkeys));
+      ++nkeys;
+    }
+
+  // Entries are moved in chunks, so they must be found in either vector.
+  ASSERT (tx.size () == (size_t)nkeys);
+  for (int i = 0; i < nkeys; ++i)
+    ASSERT (tx.find (i, std::string ("")) == mkstr (i));
+
+  // Writers move a chunk at a time until the migration is over.
+  ASSERT (tx.erase (0));
+  ASSERT (tx.insert (0, mkstr (0)));
+  while (tx.vec->next.load ())
+    ASSERT (!tx.insert (1, mkstr (1)));
+
+  ASSERT (tx.size () == (size_t)nkeys);
+  for (int i = 0; i < nkeys; ++i)
+    ASSERT (tx.find (i, std::string ("")) == mkstr (i));
+
+  // Readers must never miss a key while the table keeps growing.
+  std::atomic<bool> done { false };
+  std::vector<std::thread> thrs;
+
+  for (int i = 0; i < INSERTER_THREADS; ++i)
+    thrs.push_back (std::thread ([&tx, nkeys] (int index)
+      {
+        for (int j = 0; j < INSERTER_LOOPS; ++j)
+          {
+            int key = nkeys + index * INSERTER_LOOPS + j;
+            ASSERT (tx.insert (key, mkstr (key)));
+            if (j % 2)
+              ASSERT (tx.erase (key - 1));
+          }
+      }, i));
+
+  std::thread reader ([&] ()
+    {
+      while (!done.load ())
+        for (int i = 0; i < nkeys; ++i)
+          ASSERT (tx.find (i, std::string ("")) == mkstr (i));
+    });
+
+  for (auto& thr : thrs)
+    thr.join ();
+
+  done.store (true);
+  reader.join ();
+
+  ASSERT (tx.size () == (size_t)(nkeys + INSERTER_THREADS *
+                                 INSERTER_LOOPS / 2));
+  for (const auto& p : tx)
+    ASSERT (mkstr (p.first) == p.second);
+}
+
+// Set while an insertion of the key -1 is held up in its hash function.
+static std::atomic<int> HASH_HOLD;
+
+struct holding_hash
+{
+  size_t operator() (int key) const
+    {
+      int exp = 0;
+      if (key == -1 && HASH_HOLD.compare_exchange_strong (exp, 1))
+        while (HASH_HOLD.load () != 2)
+          std::this_thread::yield ();
+
+      return (std::hash<int> () (key));
+    }
+};
+
+typedef xrcu::hash_table<int, int, std::equal_to<int>,
+                         holding_hash> hold_table_t;
+
+void test_assign_race ()
+{
+  std::vector<std::pair<int, int>> src;
+  for (int i = 0; i < 5000; ++i)
+    src.push_back (std::make_pair (i, i));
+
+  hold_table_t tx;
+  for (int round = 0; round < 2; ++round)
+    {
+      // Hold an insertion while the vector it looked at is replaced.
+      HASH_HOLD.store (0);
+      std::thread thr ([&tx] ()
+        {
+          ASSERT (tx.insert (-1, -1));
+        });
+
+      while (HASH_HOLD.load () != 1)
+        std::this_thread::yield ();
+
+      if (round == 0)
+        tx.assign (src.begin (), src.end ());
+      else
+        tx = hold_table_t (src.begin (), src.end ());
+
+      auto limit = tx.grow_limit.load ();
+      HASH_HOLD.store (2);
+      thr.join ();
+
+      // It must land in the new vector without starting a migration.
+      ASSERT (tx.size () == src.size () + 1);
+      ASSERT (tx.find (-1, 0) == -1);
+      ASSERT (tx.grow_limit.load () == limit - 1);
+      ASSERT (!tx.vec->spare.load () && !tx.vec->next.load ());
+    }
+}
+
+void test_tombstones ()
+{
+  table_t tx;
+  const int NLIVE = 1000;
+
+  for (int i = 0; i < NLIVE; ++i)
+    tx.insert (i, mkstr (i));
+
+  // Churn with a constant number of keys must not grow the table.
+  tx._Finish_migration ();
+  size_t pidx = tx.vec->pidx;
+
+  for (int i = NLIVE; i < NLIVE * 100; ++i)
+    {
+      ASSERT (tx.insert (i, mkstr (i)));
+      ASSERT (tx.erase (i - NLIVE));
+    }
+
+  ASSERT (tx.size () == (size_t)NLIVE);
+  ASSERT (tx._Finish_migration ()->pidx <= pidx);
+
+  for (int i = NLIVE * 99; i < NLIVE * 100; ++i)
+    ASSERT (tx.find (i, std::string ("")) == mkstr (i));
+
+  // After a bulk deletion, the table shrinks as erasures go on.
+  for (int i = 0; i < NLIVE * 100; ++i)
+    tx.insert (i, mkstr (i));
+
+  pidx = tx._Finish_migration ()->pidx;
+  for (int i = 0; i < NLIVE * 100 - 10; ++i)
+    ASSERT (tx.erase (i));
+
+  ASSERT (tx.size () == 10);
+
+  // Without waiting for more writes to finish the migration.
+  ASSERT (tx.vec->pidx < pidx);
+  ASSERT (!tx.vec->spare.load () && !tx.vec->next.load ());
+
+  for (int i = NLIVE * 100 - 10; i < NLIVE * 100; ++i)
+    ASSERT (tx.find (i, std::string ("")) == mkstr (i));
+
+  // Shrinking can be disabled.
+  ASSERT (tx.shrink_factor (0) > 0);
+  pidx = tx._Finish_migration ()->pidx;
+
+  for (int i = 0; i < 10000; ++i)
+    tx.insert (i, mkstr (i));
+  for (int i = 0; i < 10000; ++i)
+    tx.erase (i);
+
+  ASSERT (tx._Finish_migration ()->pidx > pidx);
+}
+
+typedef xrcu::hash_table<int, std::string, std::equal_to<int>,
+                         std::hash<int>, test_allocator<int>,
+                         xrcu::default_domain, xrcu::lwlock,
+                         xrcu::ht_pow2_policy> pow2_table_t;
+
+void test_pow2 ()
+{
+  // The probe sequence must visit every entry exactly once.
+  std::vector<bool> seen (64);
+  xrcu::ht_pow2_policy::probe pr (12345, seen.size ());
+
+  do
+    {
+      ASSERT (!seen[pr.idx]);
+      seen[pr.idx] = true;
+    }
+  while (pr.next ());
+
+  ASSERT (std::count (seen.begin (), seen.end (), true) == 64);
+
+  pow2_table_t tx;
+  for (int i = 0; i < 4000; ++i)
+    ASSERT (tx.insert (i, mkstr (i)));
+
+  auto vp = tx._Finish_migration ();
+  ASSERT ((vp->entries & (vp->entries - 1)) == 0);
+
+  for (int i = 0; i < 4000; i += 2)
+    ASSERT (tx.erase (i));
+
+  ASSERT (tx.size () == 2000);
+  for (int i = 0; i < 4000; ++i)
+    ASSERT (tx.contains (i) == (i % 2 != 0));
+
+  // Concurrent insertions across several migrations.
+  pow2_table_t t2;
+  std::vector<std::thread> thrs;
+
+  for (int i = 0; i < INSERTER_THREADS; ++i)
+    thrs.push_back (std::thread ([&t2] (int index)
+      {
+        for (int j = 0; j < INSERTER_LOOPS; ++j)
+          {
+            int key = index * INSERTER_LOOPS + j;
+            ASSERT (t2.insert (key, mkstr (key)));
+          }
+      }, i));
+
+  for (auto& thr : thrs)
+    thr.join ();
+
+  ASSERT (t2.size () == INSERTER_THREADS * INSERTER_LOOPS);
+  for (const auto& p : t2)
+    ASSERT (mkstr (p.first) == p.second);
+}
+
 test_module hash_table_tests
 {
   "hash table",
@@ -317,7 +627,12 @@ test_module hash_table_tests
     { "multi threaded overlapped erasures", test_erase_mt_ov },
     { "multi threaded mutations", test_mutate_mt },
     { "multi threaded updates", test_update_mt },
-    { "iteration during modifications", test_iter }
+    { "iteration during modifications", test_iter },
+    { "queue-based lock", test_queue_lock },
+    { "incremental migration", test_migration },
+    { "upserts racing with assignments", test_assign_race },
+    { "tombstones and shrinking", test_tombstones },
+    { "power of two sizes", test_pow2 }
   }
 };
 
@@ -198,6 +198,80 @@ void test_erase_mt_ov ()
   ASSERT (sl_consistent (sx));
 }
 
+void test_levels ()
+{
+  // The generator must produce random bits across the whole word.
+  uint64_t ors = 0, ands = ~(uint64_t)0;
+  for (int i = 0; i < 64; ++i)
+    {
+      uint64_t val = xrcu::xrand64 ();
+      ors |= val;
+      ands &= val;
+    }
+
+  ASSERT (ors == ~(uint64_t)0);
+  ASSERT (ands == 0);
+
+  // With a zero probability, every node has a single level.
+  xrcu::skip_list<int> flat { std::less<int> (), 16, 0. };
+  for (int i = 0; i < 1000; ++i)
+    flat.insert (i);
+
+  ASSERT (flat._Hiwater () == 1);
+  ASSERT (flat.size () == 1000);
+
+  // A higher probability makes taller towers, up to the maximum depth.
+  const int NELEM = 50000;
+  xrcu::skip_list<int> tall { std::less<int> (), 16, 0.5 };
+  xrcu::skip_list<int> low { std::less<int> (), 16, 0.125 };
+  for (int i = 0; i < NELEM; ++i)
+    {
+      tall.insert (i);
+      low.insert (i);
+    }
+
+  ASSERT (tall._Hiwater () > 10);
+  ASSERT (tall._Hiwater () <= 16);
+  ASSERT (low._Hiwater () < tall._Hiwater ());
+
+  int expected = 0;
+  for (int val : tall)
+    ASSERT (val == expected++);
+
+  ASSERT (expected == NELEM);
+  for (int i = 0; i < NELEM; i += 2)
+    ASSERT (tall.erase (i));
+
+  ASSERT (tall.size () == NELEM / 2);
+  ASSERT (!tall.contains (100) && tall.contains (101));
+
+  // Settings follow the nodes when swapping, moving and copying.
+  xrcu::skip_list<int> shallow { std::less<int> (), 2, 0.5 };
+  shallow.swap (tall);
+  for (int i = 0; i < 1000; ++i)
+    {
+      tall.insert (NELEM + i);
+      shallow.insert (NELEM + i);
+    }
+
+  ASSERT (tall.size () == 1000);
+  ASSERT (tall._Hiwater () <= 2);
+  ASSERT (shallow.size () == NELEM / 2 + 1000);
+
+  xrcu::skip_list<int> copy (tall);
+  for (int i = 0; i < 1000; ++i)
+    copy.insert (-i);
+
+  ASSERT (copy._Hiwater () <= 2);
+
+  tall = std::move (shallow);
+  for (int i = 0; i < 1000; ++i)
+    tall.insert (NELEM * 2 + i);
+
+  ASSERT (tall.size () == NELEM / 2 + 2000);
+  ASSERT (tall.contains (101) && tall.contains (NELEM * 2 + 999));
+}
+
 test_module skip_list_tests
 {
   "skip list",
@@ -206,7 +280,8 @@ test_module skip_list_tests
     { "multi threaded insertions", test_insert_mt },
     { "multi threaded overlapped insertions", test_insert_mt_ov },
     { "multi threaded erasures", test_erase_mt },
-    { "multi threaded overlapped erasures", test_erase_mt_ov }
+    { "multi threaded overlapped erasures", test_erase_mt_ov },
+    { "level probabilities", test_levels }
   }
 };
 
@@ -2,9 +2,21 @@
 #define __XRCU_TESTS_XRCU__   1
 
 #include "xrcu/xrcu.hpp"
+#include "xrcu/xatomic.hpp"
+#include "xrcu/hash_table.hpp"
+#include "xrcu/lwlock.hpp"
+#include "xrcu/seqlock.hpp"
+#include "xrcu/skip_list.hpp"
+#include "xrcu/stack.hpp"
 #include "utils.hpp"
+#include <algorithm>
 #include <thread>
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <system_error>
 
 namespace xrcu_test
 {
@@ -70,6 +82,31 @@ void test_xrcu ()
   ASSERT (xrcu::ctz (0x80000000u) == 31);
 }
 
+static void
+mt_register ()
+{
+  xrcu::register_thread ();
+  xrcu::enter_cs ();
+  xrcu::finalize (new tst_fin ());
+  ASSERT (!xrcu::unregister_thread ());
+  xrcu::exit_cs ();
+
+  ASSERT (xrcu::unregister_thread ());
+  ASSERT (G_CNT.load () == 1);
+  ASSERT (!xrcu::in_cs ());
+
+  // Using the API again registers the thread once more.
+  xrcu::cs_guard g;
+  ASSERT (xrcu::in_cs ());
+}
+
+void test_xrcu_register ()
+{
+  G_CNT.store (0);
+  std::thread thr (mt_register);
+  thr.join ();
+}
+
 void test_xrcu_order ()
 {
   xrcu::finalize (new fin1 ());
@@ -84,6 +121,883 @@ mt_xrcu (tst_fin *fp)
   finalize (fp);
 }
 
+static std::thread::id fin_tid;
+static std::atomic<int> FOREIGN_CNT;
+
+struct tid_fin : public xrcu::finalizable
+{
+  ~tid_fin ()
+    {
+      if (std::this_thread::get_id () != fin_tid)
+        FOREIGN_CNT.fetch_add (1);
+    }
+};
+
+static void
+mt_async (int n)
+{
+  fin_tid = std::this_thread::get_id ();
+  xrcu::cs_guard g;
+
+  for (int i = 0; i < n; ++i)
+    xrcu::finalize (new tid_fin ());
+}
+
+void test_xrcu_async ()
+{
+  const int NOBJS = 2500;
+
+  ASSERT (!xrcu::async_reclaim (true));
+  ASSERT (xrcu::async_reclaim ());
+
+  {
+    // Can't wait for the reclaimer thread from a critical section.
+    xrcu::cs_guard g;
+    ASSERT (!xrcu::async_reclaim (false));
+    ASSERT (xrcu::async_reclaim ());
+  }
+
+  FOREIGN_CNT.store (0);
+  std::thread thr (mt_async, NOBJS);
+  thr.join ();
+
+  // Disabling background reclamation drains the pending objects.
+  ASSERT (xrcu::async_reclaim (false));
+  ASSERT (!xrcu::async_reclaim ());
+  ASSERT (FOREIGN_CNT.load () == NOBJS);
+}
+
+struct gp_obj
+{
+  std::atomic<bool> alive { true };
+};
+
+static std::atomic<gp_obj *> GP_PTR;
+static std::atomic<bool> GP_DONE;
+
+static void
+mt_gp_reader ()
+{
+  while (!GP_DONE.load ())
+    {
+      xrcu::cs_guard g;
+      auto p = GP_PTR.load ();
+
+      for (int i = 0; i < 10; ++i)
+        xrcu::xatomic_spin_nop ();
+
+      ASSERT (p->alive.load ());
+    }
+}
+
+static void
+mt_gp_writer (std::vector<gp_obj *> *outp)
+{
+  for (int i = 0; i < 50; ++i)
+    {
+      auto old = GP_PTR.exchange (new gp_obj ());
+      ASSERT (xrcu::sync ());
+      old->alive.store (false);
+      // Keep the memory around so that a bad read can be detected.
+      outp->push_back (old);
+    }
+}
+
+void test_xrcu_gp_sharing ()
+{
+  const int NREADERS = 4, NWRITERS = 4;
+  std::vector<std::thread> rd, wr;
+  std::vector<gp_obj *> retired[NWRITERS];
+
+  GP_PTR.store (new gp_obj ());
+  GP_DONE.store (false);
+
+  for (int i = 0; i < NREADERS; ++i)
+    rd.push_back (std::thread (mt_gp_reader));
+  for (int i = 0; i < NWRITERS; ++i)
+    wr.push_back (std::thread (mt_gp_writer, &retired[i]));
+
+  for (auto& thr : wr)
+    thr.join ();
+
+  GP_DONE.store (true);
+  for (auto& thr : rd)
+    thr.join ();
+
+  for (auto& vec : retired)
+    for (auto p : vec)
+      delete p;
+
+  delete GP_PTR.load ();
+}
+
+void test_xrcu_polling ()
+{
+  uintptr_t cookie = xrcu::get_state ();
+  ASSERT (!xrcu::poll_state (cookie));
+  ASSERT (xrcu::sync ());
+  ASSERT (xrcu::poll_state (cookie));
+  ASSERT (xrcu::cond_sync (cookie));
+
+  // A grace period started by 'start_poll' completes on its own.
+  cookie = xrcu::start_poll ();
+  for (int i = 0; i < 5000 && !xrcu::poll_state (cookie); ++i)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+  ASSERT (xrcu::poll_state (cookie));
+
+  cookie = xrcu::get_state ();
+  ASSERT (xrcu::cond_sync (cookie));
+  ASSERT (xrcu::poll_state (cookie));
+
+  {
+    xrcu::cs_guard g;
+    ASSERT (!xrcu::cond_sync (xrcu::get_state ()));
+    ASSERT (!xrcu::sync_for (std::chrono::milliseconds (1)));
+  }
+
+  // A reader that stays in a critical section makes 'sync_for' time out.
+  std::atomic<int> state { 0 };
+  std::thread rd ([&] ()
+    {
+      xrcu::cs_guard g;
+      state.store (1);
+      while (state.load () != 2)
+        std::this_thread::yield ();
+    });
+
+  while (state.load () != 1)
+    std::this_thread::yield ();
+
+  cookie = xrcu::get_state ();
+  ASSERT (!xrcu::sync_for (std::chrono::milliseconds (10)));
+  ASSERT (!xrcu::poll_state (cookie));
+
+  state.store (2);
+  rd.join ();
+
+  ASSERT (xrcu::sync_for (std::chrono::seconds (10)));
+  ASSERT (xrcu::poll_state (cookie));
+}
+
+void test_xrcu_defer ()
+{
+  G_CNT.store (0);
+
+  {
+    xrcu::cs_guard g;
+    // Small callables, including move-only ones.
+    xrcu::defer ([] () { G_CNT.fetch_add (1); });
+    std::unique_ptr<tst_fin> up (new tst_fin ());
+    xrcu::defer ([p = std::move (up)] () mutable { p.reset (); });
+
+    // Large callables.
+    char buf[64] = { 1 };
+    xrcu::defer ([buf] () { G_CNT.fetch_add (buf[0]); });
+
+    ASSERT (!xrcu::flush_finalizers ());
+    ASSERT (G_CNT.load () == 0);
+  }
+
+  ASSERT (G_CNT.load () == 3);
+
+  // Callbacks are run in order, and more of them than fit in a block.
+  int last = -1;
+  for (int i = 0; i < 100; ++i)
+    xrcu::defer ([&last, i] ()
+      {
+        ASSERT (last == i - 1);
+        last = i;
+      });
+
+  ASSERT (xrcu::flush_finalizers ());
+  ASSERT (last == 99);
+
+  // Callbacks deferred by a callback wait for another grace period.
+  int stage = 0;
+  xrcu::defer ([&stage] ()
+    {
+      stage = 1;
+      xrcu::defer ([&stage] () { stage = 2; });
+    });
+
+  ASSERT (xrcu::flush_finalizers ());
+  ASSERT (stage == 1);
+  ASSERT (xrcu::flush_finalizers ());
+  ASSERT (stage == 2);
+
+  // Same, for a domain.
+  xrcu::rcu_domain dom;
+  dom.defer ([] () { G_CNT.fetch_add (1); });
+  ASSERT (dom.flush_finalizers ());
+  ASSERT (G_CNT.load () == 4);
+
+  // Callbacks left behind by an exiting thread.
+  std::thread ([&] ()
+    {
+      dom.defer ([] () { G_CNT.fetch_add (1); });
+    }).join ();
+
+  ASSERT (dom.sync ());
+  ASSERT (G_CNT.load () == 5);
+}
+
+struct sized_fin : public tst_fin
+{
+  size_t nbytes;
+
+  sized_fin (size_t n) : nbytes (n)
+    {
+    }
+
+  size_t fin_size () const
+    {
+      return (this->nbytes);
+    }
+};
+
+static const int BUDGET_FINS = 200;
+
+void test_xrcu_budget ()
+{
+  ASSERT (xrcu::flush_finalizers ());
+  G_CNT.store (0);
+
+  // Large objects are reclaimed before reaching the limit on their number.
+  xrcu::finalize (new sized_fin (1 << 19));
+  ASSERT (G_CNT.load () == 0);
+  xrcu::finalize (new sized_fin (1 << 19));
+  ASSERT (G_CNT.load () == 2);
+
+  // Pending bytes are published in batches.
+  size_t prev = xrcu::pending_bytes ();
+  for (int i = 0; i < 10; ++i)
+    xrcu::finalize (new sized_fin (1 << 12));
+
+  ASSERT (xrcu::pending_bytes () > prev);
+  ASSERT (xrcu::flush_finalizers ());
+  ASSERT (xrcu::pending_bytes () == prev);
+  G_CNT.store (0);
+
+  // Clearing a stack accounts for every node, not just the first one.
+  {
+    xrcu::stack<int> stk;
+    for (int i = 0; i < 1000; ++i)
+      stk.push (i);
+
+    stk.clear ();
+    ASSERT (xrcu::pending_bytes () >= prev + 1000 * sizeof (int));
+    ASSERT (xrcu::flush_finalizers ());
+    ASSERT (xrcu::pending_bytes () == prev);
+  }
+
+  // Once the budget is exceeded, writers reclaim synchronously.
+  ASSERT (xrcu::memory_budget (1 << 14) == 0);
+  ASSERT (xrcu::memory_budget () == 1 << 14);
+
+  {
+    xrcu::cs_guard g;
+    for (int i = 0; i < 8; ++i)
+      xrcu::finalize (new sized_fin (1 << 12));
+
+    // Can't reclaim anything while in a critical section.
+    ASSERT (G_CNT.load () == 0);
+  }
+
+  ASSERT (G_CNT.load () == 8);
+  for (int i = 0; i < 8; ++i)
+    xrcu::finalize (new sized_fin (1 << 12));
+
+  ASSERT (G_CNT.load () > 8);
+  ASSERT (xrcu::memory_budget (0) == 1 << 14);
+  ASSERT (xrcu::flush_finalizers ());
+  ASSERT (G_CNT.load () == 16);
+
+  /*
+   * The budget also holds with background reclamation: writers that
+   * finalize from a critical section wait once they leave it, instead
+   * of handing their objects off to the reclaimer thread.
+   */
+  ASSERT (!xrcu::async_reclaim (true));
+  ASSERT (xrcu::memory_budget (prev + (1 << 16)) == 0);
+
+  std::atomic<int> state { 0 }, nfins { 0 };
+  std::thread rd ([&] ()
+    {
+      xrcu::cs_guard g;
+      state.store (1);
+      while (state.load () != 2)
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    });
+
+  while (state.load () != 1)
+    std::this_thread::yield ();
+
+  std::thread wr ([&] ()
+    {
+      for (int i = 0; i < BUDGET_FINS; ++i)
+        {
+          xrcu::cs_guard g;
+          xrcu::finalize (new sized_fin (1 << 12));
+          nfins.fetch_add (1);
+        }
+    });
+
+  std::this_thread::sleep_for (std::chrono::milliseconds (50));
+  ASSERT (nfins.load () < BUDGET_FINS);
+  ASSERT (xrcu::pending_bytes () <= prev + (1 << 17));
+
+  state.store (2);
+  rd.join ();
+  wr.join ();
+  ASSERT (nfins.load () == BUDGET_FINS);
+  ASSERT (xrcu::async_reclaim (false));
+  ASSERT (xrcu::memory_budget (0) == prev + (1 << 16));
+  ASSERT (xrcu::flush_finalizers ());
+  ASSERT (G_CNT.load () == 16 + BUDGET_FINS);
+}
+
+static int G_BATCHES;
+
+struct batched_fin : public sized_fin
+{
+  batched_fin () : sized_fin (1 << 10)
+    {
+    }
+
+  static void destroy_batch (xrcu::finalizable **objs, size_t n)
+    {
+      ++G_BATCHES;
+      for (size_t i = 0; i < n; ++i)
+        delete static_cast<batched_fin *> (objs[i]);
+    }
+
+  batch_fn fin_batch () const
+    {
+      return (destroy_batch);
+    }
+};
+
+struct counted_val
+{
+  int val;
+
+  counted_val (int v) : val (v)
+    {
+    }
+
+  ~counted_val ()
+    {
+      G_CNT.fetch_add (1);
+    }
+};
+
+void test_xrcu_batch ()
+{
+  ASSERT (xrcu::flush_finalizers ());
+  G_CNT.store (0);
+  size_t prev = xrcu::pending_bytes ();
+
+  // Objects of the same type are destroyed together, in any order.
+  for (int i = 0; i < 100; ++i)
+    {
+      xrcu::finalize (new batched_fin ());
+      xrcu::finalize (new tst_fin ());
+    }
+
+  ASSERT (xrcu::pending_bytes () > prev);
+  ASSERT (xrcu::flush_finalizers ());
+  ASSERT (G_CNT.load () == 200);
+  ASSERT (G_BATCHES > 0 && G_BATCHES < 100);
+  ASSERT (xrcu::pending_bytes () == prev);
+
+  // Wrapped values are batched as well, and are still destroyed.
+  typedef xrcu::detail::wrapped_traits<false, counted_val,
+    std::allocator<counted_val>> traits;
+
+  G_CNT.store (0);
+  for (int i = 0; i < 100; ++i)
+    traits::destroy (traits::make (i));
+
+  ASSERT (G_CNT.load () == 0);
+  ASSERT (xrcu::flush_finalizers ());
+  ASSERT (G_CNT.load () == 100);
+}
+
+void test_xrcu_slab ()
+{
+  xrcu::rcu_slab<long> a1;
+  xrcu::rcu_slab<char> a2 (a1);
+  ASSERT (a1 == xrcu::rcu_slab<long> (a2));
+
+  // Freed blocks are reused by the same thread right away.
+  long *p1 = a1.allocate (1);
+  a1.deallocate (p1, 1);
+  ASSERT (a1.allocate (1) == p1);
+  a1.deallocate (p1, 1);
+
+  char *p2 = a2.allocate (10000);
+  p2[9999] = 0;
+  a2.deallocate (p2, 10000);
+
+  // Magazines of exiting threads are passed on to others.
+  const size_t BSIZE = 500;
+  std::vector<char *> blocks;
+
+  std::thread t1 ([&] ()
+    {
+      xrcu::rcu_slab<char> alloc;
+      for (int i = 0; i < 64; ++i)
+        blocks.push_back (alloc.allocate (BSIZE));
+      for (auto ptr : blocks)
+        alloc.deallocate (ptr, BSIZE);
+    });
+
+  t1.join ();
+
+  char *reused = nullptr;
+  std::thread t2 ([&] ()
+    {
+      xrcu::rcu_slab<char> alloc;
+      reused = alloc.allocate (BSIZE);
+      alloc.deallocate (reused, BSIZE);
+    });
+
+  t2.join ();
+  ASSERT (std::find (blocks.begin (), blocks.end (), reused) != blocks.end ());
+
+  // Containers recycle their retired nodes.
+  xrcu::hash_table<int, std::string, std::equal_to<int>, std::hash<int>,
+                   xrcu::rcu_slab<std::pair<int, std::string>>> ht;
+  xrcu::skip_list<int, std::less<int>, xrcu::rcu_slab<int>> sl;
+  xrcu::stack<std::string, xrcu::rcu_slab<std::string>> stk;
+
+  for (int round = 0; round < 4; ++round)
+    {
+      for (int i = 0; i < 1000; ++i)
+        {
+          ht.insert (i, mkstr (i + round));
+          sl.insert (i);
+          stk.push (mkstr (i));
+        }
+
+      ASSERT (ht.find (10).value_or ("") == mkstr (10 + round));
+      for (int i = 0; i < 1000; i += 2)
+        {
+          ASSERT (sl.erase (i));
+          stk.pop ();
+        }
+
+      ASSERT (sl.size () == 500);
+      sl.clear ();
+      stk.clear ();
+    }
+
+  ASSERT (ht.size () == 1000);
+  xrcu::flush_finalizers ();
+}
+
+#ifdef XRCU_HAVE_COROUTINES
+
+struct detached_task
+{
+  struct promise_type
+  {
+    detached_task get_return_object ()
+      {
+        return (detached_task ());
+      }
+
+    std::suspend_never initial_suspend () noexcept
+      {
+        return (std::suspend_never ());
+      }
+
+    std::suspend_never final_suspend () noexcept
+      {
+        return (std::suspend_never ());
+      }
+
+    void return_void ()
+      {
+      }
+
+    void unhandled_exception ()
+      {
+        std::terminate ();
+      }
+  };
+};
+
+static detached_task
+gp_task (std::atomic<int> *cnt)
+{
+  co_await xrcu::grace_period (xrcu::inline_executor ());
+  cnt->fetch_add (1);
+}
+
+// Collects coroutines to be resumed later.
+struct queue_executor
+{
+  std::vector<std::coroutine_handle<>> *handles;
+  std::mutex *mtx;
+
+  void operator() (std::coroutine_handle<> coro) const
+    {
+      std::lock_guard<std::mutex> g (*this->mtx);
+      this->handles->push_back (coro);
+    }
+};
+
+static detached_task
+gp_exec_task (queue_executor ex, std::atomic<int> *cnt)
+{
+  co_await xrcu::grace_period (ex);
+  cnt->fetch_add (1);
+}
+
+static detached_task
+gp_dom_task (xrcu::rcu_domain& dom, std::atomic<int> *cnt)
+{
+  co_await dom.grace_period (xrcu::inline_executor ());
+  cnt->fetch_add (1);
+}
+
+static void
+wait_for (const std::atomic<int>& cnt, int val)
+{
+  for (int i = 0; i < 5000 && cnt.load () != val; ++i)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+  ASSERT (cnt.load () == val);
+}
+
+void test_xrcu_coro ()
+{
+  const int NTASKS = 100;
+  std::atomic<int> cnt { 0 };
+  std::atomic<bool> entered { false }, release { false };
+
+  // Coroutines wait for readers without blocking the calling thread.
+  std::thread rd ([&] ()
+    {
+      xrcu::cs_guard g;
+      entered.store (true);
+      while (!release.load ())
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    });
+
+  while (!entered.load ())
+    std::this_thread::yield ();
+
+  uint64_t prev = xrcu::stats().grace_periods;
+  for (int i = 0; i < NTASKS; ++i)
+    gp_task (&cnt);
+
+  std::this_thread::sleep_for (std::chrono::milliseconds (20));
+  ASSERT (cnt.load () == 0);
+  release.store (true);
+  rd.join ();
+
+  // All of them are resumed, sharing a few grace periods.
+  wait_for (cnt, NTASKS);
+  ASSERT (xrcu::stats().grace_periods - prev < NTASKS / 2);
+
+  // Resuming through an executor.
+  std::vector<std::coroutine_handle<>> handles;
+  std::mutex mtx;
+  cnt.store (0);
+
+  gp_exec_task (queue_executor { &handles, &mtx }, &cnt);
+  for (int i = 0; i < 5000; ++i)
+    {
+      std::lock_guard<std::mutex> g (mtx);
+      if (!handles.empty ())
+        break;
+      std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    }
+
+  ASSERT (cnt.load () == 0);
+  ASSERT (handles.size () == 1);
+  handles[0].resume ();
+  ASSERT (cnt.load () == 1);
+
+  // And in a domain of our own.
+  xrcu::rcu_domain dom;
+  gp_dom_task (dom, &cnt);
+  wait_for (cnt, 2);
+}
+
+#endif
+
+static uint64_t
+sync_calls (const xrcu::rcu_stats& st)
+{
+  uint64_t ret = 0;
+  for (auto n : st.sync_latency)
+    ret += n;
+
+  return (ret);
+}
+
+void test_xrcu_stats ()
+{
+  ASSERT (xrcu::flush_finalizers ());
+  auto prev = xrcu::stats ();
+
+  xrcu::enter_cs ();
+  xrcu::finalize (new tst_fin ());
+  ASSERT (!xrcu::flush_finalizers ());
+  auto st = xrcu::stats ();
+  xrcu::exit_cs ();
+
+  ASSERT (xrcu::sync ());
+  auto next = xrcu::stats ();
+
+  // These are always available.
+  ASSERT (next.grace_periods > prev.grace_periods);
+  ASSERT (next.pending_bytes == xrcu::pending_bytes ());
+
+#ifdef XRCU_STATS
+  ASSERT (st.pending_fins == prev.pending_fins + 1);
+  ASSERT (st.deferred_flushes == prev.deferred_flushes + 1);
+  ASSERT (next.pending_fins == prev.pending_fins);
+  ASSERT (next.flushes > st.flushes);
+  ASSERT (next.poll_loops > prev.poll_loops);
+  ASSERT (sync_calls (next) >= sync_calls (prev) + 2);
+#else
+  ASSERT (st.pending_fins == 0 && st.deferred_flushes == 0);
+  ASSERT (next.poll_loops == 0 && sync_calls (next) == 0);
+#endif
+}
+
+static std::atomic<int> STALL_CNT;
+static std::thread::id stall_tid;
+static std::chrono::nanoseconds stall_time;
+
+static void
+stall_fn (std::thread::id tid, std::chrono::nanoseconds elapsed)
+{
+  stall_tid = tid;
+  stall_time = elapsed;
+  STALL_CNT.fetch_add (1);
+}
+
+void test_xrcu_stalls ()
+{
+  std::atomic<int> state { 0 };
+  std::thread rd ([&] ()
+    {
+      xrcu::cs_guard g;
+      state.store (1);
+      while (state.load () != 2)
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    });
+
+  while (state.load () != 1)
+    std::this_thread::yield ();
+
+  // Short grace periods aren't reported.
+  xrcu::stall_detection (stall_fn, std::chrono::seconds (10));
+  ASSERT (!xrcu::sync_for (std::chrono::milliseconds (20)));
+  ASSERT (STALL_CNT.load () == 0);
+
+  xrcu::stall_detection (stall_fn, std::chrono::milliseconds (10));
+  ASSERT (!xrcu::sync_for (std::chrono::milliseconds (100)));
+  ASSERT (STALL_CNT.load () == 1);
+  ASSERT (stall_tid == rd.get_id ());
+  ASSERT (stall_time >= std::chrono::milliseconds (10));
+
+  xrcu::stall_detection (nullptr, std::chrono::nanoseconds (0));
+  state.store (2);
+  rd.join ();
+  ASSERT (xrcu::sync ());
+  ASSERT (STALL_CNT.load () == 1);
+}
+
+static xrcu::rcu_domain TEST_DOMAIN;
+
+void test_xrcu_domains ()
+{
+  {
+    xrcu::rcu_domain dom;
+    dom.enter_cs ();
+    ASSERT (dom.in_cs ());
+    ASSERT (!xrcu::in_cs ());
+    ASSERT (!dom.sync ());
+    ASSERT (xrcu::sync ());
+    dom.exit_cs ();
+    ASSERT (!dom.in_cs ());
+    ASSERT (dom.sync ());
+  }
+
+  // A reader in one domain doesn't delay grace periods in another one.
+  std::atomic<int> state { 0 };
+  xrcu::rcu_domain dom;
+
+  std::thread rd ([&] ()
+    {
+      dom.enter_cs ();
+      state.store (1);
+      while (state.load () != 2)
+        std::this_thread::yield ();
+      dom.exit_cs ();
+    });
+
+  while (state.load () != 1)
+    std::this_thread::yield ();
+
+  ASSERT (xrcu::sync_for (std::chrono::seconds (10)));
+  ASSERT (!dom.sync_for (std::chrono::milliseconds (10)));
+
+  state.store (2);
+  rd.join ();
+  ASSERT (dom.sync ());
+
+  // Pending objects are reclaimed when the domain is destroyed.
+  G_CNT.store (0);
+  auto dp = new xrcu::rcu_domain ();
+  for (int i = 0; i < 10; ++i)
+    dp->finalize (new tst_fin ());
+
+  ASSERT (G_CNT.load () == 0);
+  delete dp;
+  ASSERT (G_CNT.load () == 10);
+
+  // Same, but for the objects left behind by threads that exit.
+  dp = new xrcu::rcu_domain ();
+  std::thread ([=] ()
+    {
+      for (int i = 0; i < 10; ++i)
+        dp->finalize (new tst_fin ());
+    }).join ();
+
+  delete dp;
+  ASSERT (G_CNT.load () == 20);
+
+  // Slots of destroyed domains are reused.
+  dp = new xrcu::rcu_domain ();
+  {
+    xrcu::rcu_domain tmp;
+    tmp.register_thread ();
+  }
+
+  {
+    xrcu::rcu_domain tmp;
+    tmp.enter_cs ();
+    ASSERT (tmp.in_cs ());
+    tmp.exit_cs ();
+    ASSERT (tmp.unregister_thread ());
+  }
+
+  delete dp;
+
+  // Containers may use a domain other than the global one.
+  typedef xrcu::domain_policy<TEST_DOMAIN> policy;
+  xrcu::hash_table<int, std::string, std::equal_to<int>, std::hash<int>,
+                   std::allocator<std::pair<int, std::string>>, policy> ht;
+
+  for (int i = 0; i < 1000; ++i)
+    ht.insert (i, std::to_string (i));
+
+  for (int i = 0; i < 1000; i += 2)
+    ht.erase (i);
+
+  ASSERT (ht.size () == 500);
+  ASSERT (TEST_DOMAIN.flush_finalizers ());
+}
+
+static xrcu::qsbr_domain QSBR_DOMAIN;
+
+typedef xrcu::hash_table<int, std::string, std::equal_to<int>,
+  std::hash<int>, std::allocator<std::pair<int, std::string>>,
+  xrcu::qsbr_policy<QSBR_DOMAIN>> qsbr_table;
+
+static void
+mt_qsbr_reader (qsbr_table *htp, std::atomic<bool> *done)
+{
+  QSBR_DOMAIN.register_thread ();
+  while (!done->load (std::memory_order_relaxed))
+    {
+      for (int i = 0; i < 100; ++i)
+        {
+          auto val = htp->find (i, std::string ());
+          ASSERT (val.empty () || val == std::to_string (i));
+        }
+
+      QSBR_DOMAIN.quiescent_state ();
+    }
+
+  QSBR_DOMAIN.thread_offline ();
+}
+
+void test_xrcu_qsbr ()
+{
+  QSBR_DOMAIN.register_thread ();
+  ASSERT (QSBR_DOMAIN.online ());
+  // Waiting for a grace period doesn't wait for ourselves.
+  ASSERT (QSBR_DOMAIN.sync ());
+  ASSERT (QSBR_DOMAIN.online ());
+
+  // An online thread delays grace periods until it's quiescent.
+  std::atomic<int> state { 0 };
+  std::thread rd ([&] ()
+    {
+      QSBR_DOMAIN.register_thread ();
+      state.store (1);
+      while (state.load () != 2)
+        std::this_thread::yield ();
+
+      QSBR_DOMAIN.quiescent_state ();
+      while (state.load () != 3)
+        std::this_thread::yield ();
+
+      QSBR_DOMAIN.thread_offline ();
+      while (state.load () != 4)
+        std::this_thread::yield ();
+    });
+
+  while (state.load () != 1)
+    std::this_thread::yield ();
+
+  ASSERT (!QSBR_DOMAIN.sync_for (std::chrono::milliseconds (10)));
+  state.store (2);
+  ASSERT (QSBR_DOMAIN.sync_for (std::chrono::seconds (10)));
+
+  state.store (3);
+  ASSERT (QSBR_DOMAIN.sync_for (std::chrono::seconds (10)));
+
+  // Offline threads don't delay grace periods at all.
+  ASSERT (QSBR_DOMAIN.sync_for (std::chrono::seconds (1)));
+  state.store (4);
+  rd.join ();
+
+  // Containers work unchanged with QSBR.
+  qsbr_table ht;
+  std::atomic<bool> done { false };
+  std::vector<std::thread> thrs;
+
+  for (int i = 0; i < 2; ++i)
+    thrs.push_back (std::thread (mt_qsbr_reader, &ht, &done));
+
+  for (int i = 0; i < 2000; ++i)
+    {
+      int key = i % 100;
+      if (!ht.insert (key, std::to_string (key)))
+        ht.erase (key);
+
+      QSBR_DOMAIN.quiescent_state ();
+    }
+
+  done.store (true);
+  for (auto& thr : thrs)
+    thr.join ();
+
+  QSBR_DOMAIN.thread_offline ();
+  ASSERT (!QSBR_DOMAIN.online ());
+  ASSERT (QSBR_DOMAIN.flush_finalizers ());
+}
+
 void test_xrcu_mt ()
 {
   const int NTHREADS = 100;
@@ -97,15 +1011,434 @@ void test_xrcu_mt ()
   for (auto& thr : thrs)
     thr.join ();
 
+  // Exiting threads leave their objects for the next grace period.
+  xrcu::sync ();
   ASSERT (G_CNT.load () == NTHREADS);
 }
 
+static void
+mt_churn (std::atomic<bool> *done)
+{
+  while (!done->load ())
+    xrcu::sync ();
+}
+
+void test_xrcu_churn ()
+{
+  const int NROUNDS = 20, NTHREADS = 50;
+  std::atomic<bool> done { false };
+  std::thread wr (mt_churn, &done);
+
+  G_CNT.store (0);
+  for (int i = 0; i < NROUNDS; ++i)
+    {
+      std::vector<std::thread> thrs;
+      for (int j = 0; j < NTHREADS; ++j)
+        thrs.push_back (std::thread ([] ()
+          {
+            xrcu::cs_guard g;
+            xrcu::finalize (new tst_fin ());
+            xrcu::finalize (new tst_fin ());
+          }));
+
+      for (auto& thr : thrs)
+        thr.join ();
+    }
+
+  done.store (true);
+  wr.join ();
+
+  xrcu::sync ();
+  ASSERT (G_CNT.load () == 2 * NROUNDS * NTHREADS);
+
+  /*
+   * Without background reclamation, once enough objects are orphaned,
+   * the next thread that finalizes anything reclaims them.
+   */
+#ifdef XRCU_MAX_FINS
+  const int NFINS = XRCU_MAX_FINS / 2 + 1;
+#else
+  const int NFINS = 501;
+#endif
+
+  xrcu::rcu_domain dom;
+  G_CNT.store (0);
+  for (int i = 0; i < 2; ++i)
+    std::thread ([&dom, NFINS] ()
+      {
+        for (int j = 0; j < NFINS; ++j)
+          dom.finalize (new tst_fin ());
+      }).join ();
+
+  ASSERT (G_CNT.load () == 0);
+  dom.finalize (new tst_fin ());
+  ASSERT (G_CNT.load () == 2 * NFINS + 1);
+}
+
+static xrcu::srcu_domain SRCU_DOMAIN;
+
+typedef xrcu::hash_table<int, std::string, std::equal_to<int>,
+  std::hash<int>, std::allocator<std::pair<int, std::string>>,
+  xrcu::srcu_policy<SRCU_DOMAIN>> srcu_table;
+
+static void
+mt_srcu_reader (srcu_table *ht, std::atomic<bool> *done)
+{
+  while (!done->load ())
+    for (int i = 0; i < 100; ++i)
+      {
+        auto s = ht->find (i, std::string ());
+        ASSERT (s.empty () || std::stoi (s) == i);
+      }
+}
+
+void test_xrcu_srcu ()
+{
+  // A reader may block, delaying only the grace periods of its domain.
+  std::atomic<int> state { 0 };
+  std::thread rd ([&] ()
+    {
+      unsigned int idx = SRCU_DOMAIN.read_lock ();
+      state.store (1);
+      while (state.load () != 2)
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+      SRCU_DOMAIN.read_unlock (idx);
+    });
+
+  while (state.load () != 1)
+    std::this_thread::yield ();
+
+  ASSERT (!SRCU_DOMAIN.sync_for (std::chrono::milliseconds (10)));
+  ASSERT (xrcu::sync_for (std::chrono::seconds (10)));
+  state.store (2);
+  ASSERT (SRCU_DOMAIN.sync_for (std::chrono::seconds (10)));
+  rd.join ();
+
+  // Nested sections keep track of their own indices.
+  SRCU_DOMAIN.enter_cs ();
+  SRCU_DOMAIN.enter_cs ();
+  SRCU_DOMAIN.exit_cs ();
+  SRCU_DOMAIN.exit_cs ();
+  ASSERT (SRCU_DOMAIN.sync_for (std::chrono::seconds (10)));
+
+  // Finalizers run after a grace period in the domain.
+  G_CNT.store (0);
+  SRCU_DOMAIN.finalize (new tst_fin ());
+  ASSERT (SRCU_DOMAIN.flush_finalizers ());
+  ASSERT (G_CNT.load () == 1);
+
+  // Writers that exceed the memory budget wait once out of their sections.
+  size_t prev = xrcu::pending_bytes ();
+  ASSERT (xrcu::memory_budget (prev + (1 << 16)) == 0);
+
+  std::atomic<int> nfins { 0 };
+  state.store (0);
+  rd = std::thread ([&] ()
+    {
+      unsigned int idx = SRCU_DOMAIN.read_lock ();
+      state.store (1);
+      while (state.load () != 2)
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+      SRCU_DOMAIN.read_unlock (idx);
+    });
+
+  while (state.load () != 1)
+    std::this_thread::yield ();
+
+  std::thread wr ([&] ()
+    {
+      for (int i = 0; i < BUDGET_FINS; ++i)
+        {
+          unsigned int idx = SRCU_DOMAIN.read_lock ();
+          SRCU_DOMAIN.finalize (new sized_fin (1 << 12));
+          SRCU_DOMAIN.read_unlock (idx);
+          nfins.fetch_add (1);
+        }
+    });
+
+  std::this_thread::sleep_for (std::chrono::milliseconds (50));
+  ASSERT (nfins.load () < BUDGET_FINS);
+  ASSERT (xrcu::pending_bytes () <= prev + (1 << 17));
+
+  state.store (2);
+  rd.join ();
+  wr.join ();
+  ASSERT (xrcu::memory_budget (0) == prev + (1 << 16));
+  ASSERT (SRCU_DOMAIN.flush_finalizers ());
+  ASSERT (G_CNT.load () == 1 + BUDGET_FINS);
+
+  // Containers work unchanged with sleepable domains.
+  srcu_table ht;
+  std::atomic<bool> done { false };
+  std::vector<std::thread> thrs;
+
+  for (int i = 0; i < 2; ++i)
+    thrs.push_back (std::thread (mt_srcu_reader, &ht, &done));
+
+  for (int i = 0; i < 2000; ++i)
+    {
+      int key = i % 100;
+      if (!ht.insert (key, std::to_string (key)))
+        ht.erase (key);
+    }
+
+  done.store (true);
+  for (auto& thr : thrs)
+    thr.join ();
+
+  ASSERT (SRCU_DOMAIN.flush_finalizers ());
+}
+
+static void
+rwlock_run (xrcu::rwlwlock& lk)
+{
+  // Writers keep both fields equal, so readers must never see them differ.
+  struct
+  {
+    int x = 0, y = 0;
+  } data;
+
+  std::atomic<bool> done { false };
+  std::atomic<int> bad { 0 };
+  std::vector<std::thread> thrs;
+
+  for (int i = 0; i < 4; ++i)
+    thrs.push_back (std::thread ([&] ()
+      {
+        while (!done.load (std::memory_order_relaxed))
+          {
+            std::shared_lock<xrcu::rwlwlock> g (lk);
+            int x = data.x;
+            std::this_thread::yield ();
+            if (data.y != x)
+              bad.fetch_add (1);
+          }
+      }));
+
+  std::vector<std::thread> wthrs;
+  for (int i = 0; i < 2; ++i)
+    wthrs.push_back (std::thread ([&] ()
+      {
+        for (int j = 0; j < 100; ++j)
+          {
+            std::unique_lock<xrcu::rwlwlock> g (lk);
+            ++data.x;
+            std::this_thread::yield ();
+            ++data.y;
+          }
+      }));
+
+  // Writers must make progress despite the readers.
+  for (auto& thr : wthrs)
+    thr.join ();
+
+  done.store (true);
+  for (auto& thr : thrs)
+    thr.join ();
+
+  ASSERT (bad.load () == 0);
+  ASSERT (data.x == 200 && data.y == 200);
+}
+
+void test_xrcu_rwlock ()
+{
+  xrcu::rwlwlock lk;
+  ASSERT (sizeof (lk) == sizeof (uintptr_t));
+  rwlock_run (lk);
+
+  // Readers in the RCU-biased mode are in a critical section.
+  xrcu::rwlwlock blk { true };
+  blk.acquire_shared ();
+  ASSERT (xrcu::in_cs ());
+  blk.acquire_shared ();
+  blk.release_shared ();
+  blk.release_shared ();
+  ASSERT (!xrcu::in_cs ());
+
+  // Writers can't wait for readers from inside a critical section.
+  {
+    xrcu::cs_guard g;
+    ASSERT (!blk.acquire ());
+
+    bool thrown = false;
+    try
+      {
+        std::unique_lock<xrcu::rwlwlock> wg (blk);
+      }
+    catch (const std::system_error&)
+      {
+        thrown = true;
+      }
+
+    ASSERT (thrown);
+  }
+
+  ASSERT (blk.acquire ());
+  blk.release ();
+
+  rwlock_run (blk);
+}
+
+struct seq_pair
+{
+  uintptr_t x, y;
+};
+
+struct seq_rec
+{
+  uint32_t vals[7];
+};
+
+// Trivially copyable, but not default constructible.
+struct seq_fixed
+{
+  uint32_t a, b, c;
+
+  seq_fixed (uint32_t x) : a (x), b (x + 1), c (x + 2)
+    {
+    }
+};
+
+template <typename Lock>
+static void
+seqlock_fixed ()
+{
+  Lock lk { seq_fixed (1) };
+  ASSERT (lk.load ().c == 3);
+
+  auto prev = lk.exchange (seq_fixed (10));
+  ASSERT (prev.a == 1 && prev.c == 3);
+
+  auto next = lk.update ([] (seq_fixed v, uint32_t n)
+    {
+      return (seq_fixed (v.a + n));
+    }, 5);
+
+  ASSERT (next.a == 15 && next.c == 17);
+  ASSERT (lk.load ().b == 16);
+}
+
+template <typename T, typename Fn>
+static void
+seqlock_run (T& sq, Fn check)
+{
+  std::atomic<bool> done { false };
+  std::atomic<int> bad { 0 };
+  std::vector<std::thread> thrs;
+
+  for (int i = 0; i < 3; ++i)
+    thrs.push_back (std::thread ([&] ()
+      {
+        while (!done.load (std::memory_order_relaxed))
+          if (!check (sq.load ()))
+            bad.fetch_add (1);
+      }));
+
+  std::vector<std::thread> wthrs;
+  for (int i = 0; i < 2; ++i)
+    wthrs.push_back (std::thread ([&] ()
+      {
+        for (int j = 0; j < 20000; ++j)
+          sq.update ([] (auto val)
+            {
+              for (auto& v : val.vals)
+                ++v;
+              return (val);
+            });
+      }));
+
+  for (auto& thr : wthrs)
+    thr.join ();
+
+  done.store (true);
+  for (auto& thr : thrs)
+    thr.join ();
+
+  ASSERT (bad.load () == 0);
+}
+
+void test_xrcu_seqlock ()
+{
+  xrcu::dcas_seqlock<seq_pair> sp { seq_pair { 1, 2 } };
+  ASSERT (sp.load ().x == 1 && sp.load ().y == 2);
+
+  sp.store (seq_pair { 3, 4 });
+  auto prev = sp.exchange (seq_pair { 5, 6 });
+  ASSERT (prev.x == 3 && prev.y == 4);
+
+  auto next = sp.update ([] (seq_pair p, uintptr_t n)
+    {
+      p.x += n;
+      p.y += n;
+      return (p);
+    }, 10);
+
+  ASSERT (next.x == 15 && next.y == 16);
+  ASSERT (sp.load ().x == 15);
+
+  // Values larger than two words always take the lock.
+  xrcu::dcas_seqlock<seq_rec> sr;
+  seqlock_run (sr, [] (const seq_rec& rec)
+    {
+      for (auto v : rec.vals)
+        if (v != rec.vals[0])
+          return (false);
+      return (true);
+    });
+
+  ASSERT (sr.load ().vals[6] == 40000);
+
+  struct half_rec
+  {
+    uint32_t vals[4];
+  };
+
+  auto same = [] (const half_rec& rec)
+    {
+      return (rec.vals[0] == rec.vals[1] && rec.vals[1] == rec.vals[2] &&
+              rec.vals[2] == rec.vals[3]);
+    };
+
+  xrcu::seqlock<half_rec> sh;
+  seqlock_run (sh, same);
+  ASSERT (sh.load ().vals[3] == 40000);
+
+  xrcu::dcas_seqlock<half_rec> shd;
+  seqlock_run (shd, same);
+  ASSERT (shd.load ().vals[0] == 40000);
+
+  // Values need not be default constructible.
+  seqlock_fixed<xrcu::seqlock<seq_fixed>> ();
+  seqlock_fixed<xrcu::dcas_seqlock<seq_fixed>> ();
+}
+
 test_module xrcu_tests
 {
   "xrcu",
   {
     { "API", test_xrcu },
     { "API with multiple threads", test_xrcu_mt },
+    { "short-lived threads", test_xrcu_churn },
+    { "deferred callbacks", test_xrcu_defer },
+    { "memory budget", test_xrcu_budget },
+    { "batched finalizers", test_xrcu_batch },
+    { "slab allocator", test_xrcu_slab },
+#ifdef XRCU_HAVE_COROUTINES
+    { "coroutines", test_xrcu_coro },
+#endif
+    { "runtime statistics", test_xrcu_stats },
+    { "stall detection", test_xrcu_stalls },
+    { "explicit thread registration", test_xrcu_register },
+    { "background reclamation", test_xrcu_async },
+    { "concurrent grace periods", test_xrcu_gp_sharing },
+    { "grace period polling", test_xrcu_polling },
+    { "independent domains", test_xrcu_domains },
+    { "quiescent state based domains", test_xrcu_qsbr },
+    { "sleepable domains", test_xrcu_srcu },
+    { "reader-writer locks", test_xrcu_rwlock },
+    { "sequence locks", test_xrcu_seqlock },
   }
 };
 
@@ -48,6 +48,28 @@ inline constexpr size_t table_idx (size_t idx)
 
 extern size_t vec_psize (size_t pidx);
 
+// Number of entries that are moved at once when migrating a vector.
+static constexpr size_t HT_MIGRATE_CHUNK = 128;
+// Number of entries that are initialized at once when preparing one.
+static constexpr size_t HT_FILL_CHUNK = 2048;
+
+// Claim the next chunk of work out of TOTAL items.
+inline bool
+ht_claim (std::atomic<size_t>& cursor, size_t total, size_t chunk,
+          size_t& start, size_t& end)
+{
+  start = cursor.load (std::memory_order_relaxed);
+  if (start >= total)
+    return (false);
+
+  start = cursor.fetch_add (chunk, std::memory_order_acq_rel);
+  if (start >= total)
+    return (false);
+
+  end = total - start < chunk ? total : start + chunk;
+  return (true);
+}
+
 template <typename Alloc>
 struct alignas (uintptr_t) ht_vector : public finalizable
 {
@@ -55,12 +77,21 @@ struct alignas (uintptr_t) ht_vector : public finalizable
   size_t entries;
   size_t pidx;
   std::atomic<size_t> nelems { 0 };
+  // Vector that is being initialized ahead of the next migration.
+  std::atomic<ht_vector<Alloc> *> spare { nullptr };
+  // Vector that the entries are being moved to, once it's ready.
+  std::atomic<ht_vector<Alloc> *> next { nullptr };
+  // Progress of the above, in entries of the spare vector and this one.
+  std::atomic<size_t> fill_claimed { 0 };
+  std::atomic<size_t> filled { 0 };
+  std::atomic<size_t> claimed { 0 };
+  std::atomic<size_t> moved { 0 };
 
   ht_vector (uintptr_t *ep) : data (ep) {}
 
-  static ht_vector<Alloc>* make (size_t pidx, uintptr_t key, uintptr_t val)
+  static ht_vector<Alloc>* alloc (size_t pidx, size_t entries)
     {
-      size_t entries = vec_psize (pidx), tsize = table_idx (entries);
+      size_t tsize = table_idx (entries);
 #ifdef XRCU_HAVE_XATOMIC_DCAS
       auto raw = alloc_uptrs<Alloc> (sizeof (ht_vector<Alloc>), tsize + 1);
       uintptr_t *p = (uintptr_t *)((char *)raw + sizeof (ht_vector<Alloc>));
@@ -73,19 +104,36 @@ struct alignas (uintptr_t) ht_vector : public finalizable
       uintptr_t *p = (uintptr_t *)((char *)raw + sizeof (ht_vector<Alloc>));
 #endif
       auto ret = new ((ht_vector<Alloc> *)raw) ht_vector<Alloc> (p);
-      for (size_t i = 0; i < tsize; i += 2)
-        ret->data[i] = key, ret->data[i + 1] = val;
-
       ret->entries = entries;
       ret->pidx = pidx;
       return (ret);
     }
 
+  void fill (size_t start, size_t end, uintptr_t key, uintptr_t val)
+    {
+      for (size_t i = table_idx (start); i < table_idx (end); i += 2)
+        this->data[i] = key, this->data[i + 1] = val;
+    }
+
+  static ht_vector<Alloc>* make (size_t pidx, size_t entries,
+                                 uintptr_t key, uintptr_t val)
+    {
+      auto ret = ht_vector<Alloc>::alloc (pidx, entries);
+      ret->fill (0, ret->entries, key, val);
+      return (ret);
+    }
+
   void safe_destroy ()
     {
       dealloc_uptrs<Alloc> (this, this->data + this->size ());
     }
 
+  size_t fin_size () const
+    {
+      return ((const char *)(this->data + this->size ()) -
+              (const char *)this);
+    }
+
   size_t size () const
     {
       return (table_idx (this->entries));
@@ -101,36 +149,24 @@ secondary_hash (size_t hval)
 
 extern size_t find_hsize (size_t size, float ldf, size_t& pidx);
 
+template <typename Lock>
 struct ht_sentry
 {
-  lwlock *lock;
-  uintptr_t xbit;
-  uintptr_t *data = nullptr;
-  size_t size;
+  Lock *lock;
 
-  ht_sentry (lwlock *lp, uintptr_t xb) : lock (lp), xbit (~xb)
+  ht_sentry (Lock *lp) : lock (lp)
     {
       this->lock->acquire ();
     }
 
-  void set (uintptr_t *dp, size_t sz)
-    {
-      this->data = dp;
-      this->size = sz;
-    }
-
   ~ht_sentry ()
     {
-      if (this->data)
-        for (size_t i = table_idx (0) + 1; i < this->size; i += 2)
-          xatomic_and (&this->data[i], this->xbit);
-
       this->lock->release ();
     }
 };
 
-template <typename Ktraits, typename Vtraits>
-struct ht_iter : public cs_guard
+template <typename Ktraits, typename Vtraits, typename Domain>
+struct ht_iter : public domain_guard<Domain>
 {
   const uintptr_t *data = nullptr;
   size_t nmax;
@@ -152,13 +188,13 @@ struct ht_iter : public cs_guard
     {
     }
 
-  ht_iter (const ht_iter<Ktraits, Vtraits>& right) :
+  ht_iter (const ht_iter<Ktraits, Vtraits, Domain>& right) :
       data (right.data), nmax (right.nmax), idx (right.idx),
       c_key (right.c_key), c_val (right.c_val), valid (right.valid)
     {
     }
 
-  ht_iter (ht_iter<Ktraits, Vtraits>&& right) noexcept :
+  ht_iter (ht_iter<Ktraits, Vtraits, Domain>&& right) noexcept :
       data (right.data), nmax (right.nmax), idx (right.idx),
       c_key (right.c_key), c_val (right.c_val), valid (right.valid)
     {
@@ -185,13 +221,13 @@ struct ht_iter : public cs_guard
         }
     }
 
-  bool operator== (const ht_iter<Ktraits, Vtraits>& right) const
+  bool operator== (const ht_iter<Ktraits, Vtraits, Domain>& right) const
     {
       return ((!this->valid && !right.valid) ||
               (this->data == right.data && this->idx == right.idx));
     }
 
-  bool operator!= (const ht_iter<Ktraits, Vtraits>& right) const
+  bool operator!= (const ht_iter<Ktraits, Vtraits, Domain>& right) const
     {
       return (!(*this == right));
     }
@@ -291,10 +327,119 @@ compute_fsize (float loadf, size_t entries)
 
 } // namespace detail
 
+/*
+ * Sizing policies for hash tables. Each one maps a size index to a number of
+ * entries, and defines the probe sequence used to look for keys.
+ */
+
+// Prime sizes, indexed by the hash code modulo the size.
+struct ht_prime_policy
+{
+  static size_t entries (size_t pidx)
+    {
+      return (detail::vec_psize (pidx));
+    }
+
+  static size_t find (size_t size, float ldf, size_t& pidx)
+    {
+      return (detail::find_hsize (size, ldf, pidx));
+    }
+
+  struct probe
+  {
+    size_t idx;
+    size_t initial;
+    size_t sec;
+    size_t nmax;
+
+    probe (size_t code, size_t n) :
+        idx (code % n), initial (idx),
+        sec (detail::secondary_hash (code)), nmax (n)
+      {
+      }
+
+    // Move to the next index. Returns false once every one was visited.
+    bool next ()
+      {
+        if ((this->idx += this->sec) >= this->nmax)
+          this->idx -= this->nmax;
+
+        return (this->idx != this->initial);
+      }
+  };
+};
+
+/*
+ * Power of two sizes, indexed by masking the hash code. Since the low bits
+ * of the code are all that matter, it's mixed first, and collisions are
+ * resolved with triangular probing, which visits every index.
+ */
+struct ht_pow2_policy
+{
+  static constexpr size_t MIN_SHIFT = 3;
+
+  static size_t entries (size_t pidx)
+    {
+      return ((size_t)1 << (pidx + MIN_SHIFT));
+    }
+
+  static size_t find (size_t size, float ldf, size_t& pidx)
+    {
+      pidx = 0;
+      while (pidx < sizeof (size_t) * 8 - MIN_SHIFT - 2 &&
+             entries (pidx) < size)
+        ++pidx;
+
+      return ((size_t)(entries (pidx) * ldf));
+    }
+
+  static size_t mix (size_t code)
+    {
+      if constexpr (sizeof (code) > sizeof (uint32_t))
+        {
+          code ^= code >> 30;
+          code *= 0xbf58476d1ce4e5b9ull;
+          code ^= code >> 27;
+          code *= 0x94d049bb133111ebull;
+          code ^= code >> 31;
+        }
+      else
+        {
+          code ^= code >> 16;
+          code *= 0x85ebca6bu;
+          code ^= code >> 13;
+          code *= 0xc2b2ae35u;
+          code ^= code >> 16;
+        }
+
+      return (code);
+    }
+
+  struct probe
+  {
+    size_t idx;
+    size_t mask;
+    size_t step = 0;
+
+    probe (size_t code, size_t n) : idx (mix (code) & (n - 1)), mask (n - 1)
+      {
+      }
+
+    bool next ()
+      {
+        this->idx = (this->idx + ++this->step) & this->mask;
+        return (this->step <= this->mask);
+      }
+  };
+};
+
 template <typename KeyT, typename ValT,
           typename EqFn = std::equal_to<KeyT>,
           typename HashFn = std::hash<KeyT>,
-          typename Alloc = std::allocator<std::pair<KeyT, ValT>>>
+          typename Alloc = std::allocator<std::pair<KeyT, ValT>>,
+          typename Domain = default_domain,
+          typename Lock = lwlock,
+          typename Sizing = ht_prime_policy>
 struct hash_table
 {
   using Nalloc = typename std::allocator_traits<Alloc>::template
@@ -302,13 +447,14 @@ struct hash_table
 
   typedef detail::wrapped_traits<(
       sizeof (KeyT) < sizeof (uintptr_t) &&
-      std::is_integral<KeyT>::value), KeyT, Alloc> key_traits;
+      std::is_integral<KeyT>::value), KeyT, Alloc, Domain> key_traits;
 
   typedef detail::wrapped_traits<(
       sizeof (ValT) < sizeof (uintptr_t) &&
-      std::is_integral<ValT>::value), ValT, Alloc> val_traits;
+      std::is_integral<ValT>::value), ValT, Alloc, Domain> val_traits;
 
-  typedef hash_table<KeyT, ValT, EqFn, HashFn, Alloc> self_type;
+  typedef hash_table<KeyT, ValT, EqFn, HashFn,
+                     Alloc, Domain, Lock, Sizing> self_type;
   typedef KeyT key_type;
   typedef ValT mapped_type;
   typedef std::pair<KeyT, ValT> value_type;
@@ -325,8 +471,9 @@ struct hash_table
   EqFn eqfn;
   HashFn hashfn;
   float loadf = 0.85f;
+  float shrinkf = 0.1f;
   std::atomic<intptr_t> grow_limit;
-  lwlock lock;
+  Lock lock;
 
   void _Set_loadf (float ldf)
     {
@@ -348,11 +495,33 @@ struct hash_table
       return (this->loadf);
     }
 
+  void _Set_shrinkf (float sf)
+    {
+      if (sf >= 0.f && sf <= 0.5f)
+        this->shrinkf = sf;
+    }
+
+  float shrink_factor (float sf)
+    {
+      this->lock.acquire ();
+      float ret = this->shrinkf;
+      this->_Set_shrinkf (sf);
+      this->lock.release ();
+      return (ret);
+    }
+
+  float shrink_factor () const
+    {
+      return (this->shrinkf);
+    }
+
   void _Init (size_t size, float ldf, EqFn e, HashFn h)
     {
       this->_Set_loadf (ldf);
-      size_t pidx, gt = detail::find_hsize (size, this->loadf, pidx);
-      this->vec = detail::ht_vector<Nalloc>::make (pidx, key_traits::FREE,
+      size_t pidx, gt = Sizing::find (size, this->loadf, pidx);
+      this->vec = detail::ht_vector<Nalloc>::make (pidx,
+                                                   Sizing::entries (pidx),
+                                                   key_traits::FREE,
                                                    val_traits::FREE);
       this->eqfn = e;
       this->hashfn = h;
@@ -388,10 +557,12 @@ struct hash_table
 
   hash_table (self_type&& right) noexcept
     {
+      right._Finish_migration ();
       this->vec = right.vec;
       this->eqfn = right.eqfn;
       this->hashfn = right.hashfn;
       this->loadf = right.loadf;
+      this->shrinkf = right.shrinkf;
       this->grow_limit.store ((intptr_t)(this->loadf * this->size ()),
                               std::memory_order_relaxed);
 
@@ -400,14 +571,23 @@ struct hash_table
 
   size_t size () const
     {
-      cs_guard g;
-      return (this->vec->nelems.load (std::memory_order_relaxed));
+      domain_guard<Domain> g;
+      size_t ret = 0;
+
+      // During a migration, the entries are split between two vectors.
+      for (auto vp = this->vec; vp; )
+        {
+          ret += vp->nelems.load (std::memory_order_relaxed);
+          vp = vp->next.load (std::memory_order_acquire);
+        }
+
+      return (ret);
     }
 
   size_t max_size () const
     {
       size_t out;
-      return (detail::find_hsize (~(size_t)0, 0.85f, out));
+      return (Sizing::find (~(size_t)0, 0.85f, out));
     }
 
   bool empty () const
@@ -418,37 +598,23 @@ struct hash_table
   size_t _Probe (const KeyT& key, const detail::ht_vector<Nalloc> *vp,
                  bool put_p, bool& found) const
     {
-      size_t code = this->hashfn (key);
-      size_t entries = vp->entries;
-      size_t idx = code % entries;
-      size_t vidx = detail::table_idx (idx);
-
+      typename Sizing::probe pr (this->hashfn (key), vp->entries);
       found = false;
-      uintptr_t k = vp->data[vidx];
 
-      if (k == key_traits::FREE)
-        return (put_p ? (found = true, vidx) : (size_t)-1);
-      else if (k != key_traits::DELT &&
-               this->eqfn (key_traits::get (k), key))
-        return (vidx);
-
-      for (size_t initial = idx, sec = detail::secondary_hash (code) ; ; )
+      do
         {
-          if ((idx += sec) >= entries)
-            idx -= entries;
-
-          if (idx == initial)
-            return ((size_t)-1);
-
-          vidx = detail::table_idx (idx);
-          k = vp->data[vidx];
+          size_t vidx = detail::table_idx (pr.idx);
+          uintptr_t k = vp->data[vidx];
 
           if (k == key_traits::FREE)
             return (put_p ? (found = true, vidx) : (size_t)-1);
-          else if (k != key_traits::DELT &&
+          else if (k != key_traits::DELT && (k & key_traits::XBIT) == 0 &&
                    this->eqfn (key_traits::get (k), key))
             return (vidx);
         }
+      while (pr.next ());
+
+      return ((size_t)-1);
     }
 
   size_t _Probe (const KeyT& key, const detail::ht_vector<Nalloc> *vp,
@@ -460,82 +626,241 @@ struct hash_table
 
   size_t _Gprobe (uintptr_t key, detail::ht_vector<Nalloc> *vp)
     {
-      size_t code = this->hashfn (key_traits::get (key));
-      size_t entries = vp->entries;
-      size_t idx = code % entries;
-      size_t vidx = detail::table_idx (idx);
+      typename Sizing::probe pr (this->hashfn (key_traits::get (key)),
+                                 vp->entries);
 
-      if (vp->data[vidx] == key_traits::FREE)
-        return (vidx);
+      while (vp->data[detail::table_idx (pr.idx)] != key_traits::FREE)
+        pr.next ();
 
-      for (size_t sec = detail::secondary_hash (code) ; ; )
-        {
-          if ((idx += sec) >= entries)
-            idx -= entries;
+      return (detail::table_idx (pr.idx));
+    }
 
-          vidx = detail::table_idx (idx);
-          if (vp->data[vidx] == key_traits::FREE)
-            return (vidx);
+  void _Move_entry (detail::ht_vector<Nalloc> *np,
+                    uintptr_t key, uintptr_t val)
+    {
+      while (true)
+        {
+          size_t idx = this->_Gprobe (key, np);
+#ifdef XRCU_HAVE_XATOMIC_DCAS
+          if (xatomic_dcas_bool (&np->data[idx], key_traits::FREE,
+                                 val_traits::FREE, key, val))
+            return;
+#else
+          if (xatomic_cas_bool (&np->data[idx], key_traits::FREE, key))
+            {
+              np->data[idx + 1] = val;
+              return;
+            }
+#endif
         }
     }
 
-  void _Rehash ()
+  /*
+   * Move a chunk of entries out of a vector that's being migrated. Returns
+   * false if there was nothing left to claim.
+   */
+  bool _Migrate_chunk (detail::ht_vector<Nalloc> *vp)
     {
-      detail::ht_sentry s (&this->lock, val_traits::XBIT);
-      if (!(this->grow_limit.load (std::memory_order_relaxed) <= 0))
-        return;
+      size_t start, end, nmoved = 0;
+      if (!detail::ht_claim (vp->claimed, vp->entries,
+                             detail::HT_MIGRATE_CHUNK, start, end))
+        return (false);
+
+      auto np = vp->next.load (std::memory_order_acquire);
+
+      for (size_t i = start; i < end; ++i)
+        {
+          uintptr_t *ep = vp->data + detail::table_idx (i);
+
+          // Freeze the value, so that it can't change until it's moved.
+          uintptr_t val = xatomic_or (ep + 1, val_traits::XBIT) &
+                          ~val_traits::XBIT;
+          uintptr_t key = ep[0];
+
+          if (key == key_traits::FREE || key == key_traits::DELT ||
+              val == val_traits::FREE || val == val_traits::DELT)
+            continue;
+
+          this->_Move_entry (np, key, val);
+          // From now on, lookups skip this entry and go to the new vector.
+          ep[0] = key | key_traits::XBIT;
+          ++nmoved;
+        }
+
+      np->nelems.fetch_add (nmoved, std::memory_order_acq_rel);
+      vp->nelems.fetch_sub (nmoved, std::memory_order_acq_rel);
+
+      if (vp->moved.fetch_add (end - start, std::memory_order_acq_rel) +
+          (end - start) == vp->entries)
+        { // We moved the last chunk - Switch to the new vector.
+          std::atomic_thread_fence (std::memory_order_release);
+          this->vec = np;
+          Domain::finalize (vp);
+        }
 
-      auto old = this->vec;
-      size_t nelem = 0;
-      auto np = detail::ht_vector<Nalloc>::make (old->pidx + 1,
-                                                 key_traits::FREE,
-                                                 val_traits::FREE);
+      return (true);
+    }
 
-      s.set (old->data, old->size ());
+  // Index of the smallest vector in which SIZE entries use half the limit.
+  size_t _Target_pidx (size_t size) const
+    {
+      size_t pidx;
+      Sizing::find ((size_t)(2 * size / this->loadf), this->loadf, pidx);
+      return (pidx);
+    }
 
-      for (size_t i = detail::table_idx (0); i < old->size (); i += 2)
+  /*
+   * Initialize a chunk of the vector that will replace VP. Once that's
+   * done, the migration can start. Returns false if there was nothing
+   * left to claim.
+   */
+  bool _Prepare (detail::ht_vector<Nalloc> *vp, bool shrink = false)
+    {
+      auto np = vp->spare.load (std::memory_order_acquire);
+      if (!np)
         {
-          uintptr_t key = old->data[i];
-          uintptr_t val = xatomic_or (&old->data[i + 1], val_traits::XBIT);
+          if (vp != this->vec || vp->next.load (std::memory_order_relaxed))
+            return (false);
 
-          if (key != key_traits::FREE && key != key_traits::DELT &&
-              val != val_traits::FREE && val != val_traits::DELT)
+          detail::ht_sentry<Lock> s (&this->lock);
+          if (vp != this->vec || vp->next.load (std::memory_order_relaxed))
+            return (false);
+
+          np = vp->spare.load (std::memory_order_relaxed);
+          if (!np)
             {
-              size_t nidx = this->_Gprobe (key, np);
-              np->data[nidx + 0] = key;
-                  np->data[nidx + 1] = val;
-              ++nelem;
+              /*
+               * The new vector is sized after the live entries only, since
+               * tombstones are left behind. When they make up most of the
+               * used entries, this means that the vector keeps its size.
+               */
+              size_t live = vp->nelems.load (std::memory_order_relaxed);
+              size_t pidx = this->_Target_pidx (live);
+
+              if (shrink && pidx >= vp->pidx)
+                return (false);
+
+              np = detail::ht_vector<Nalloc>::alloc (pidx,
+                                                     Sizing::entries (pidx));
+
+              // Don't let in more entries than the new vector can take.
+              intptr_t cap = detail::compute_fsize (this->loadf,
+                                                    np->entries) -
+                             (intptr_t)live;
+              auto limit = this->grow_limit.load (std::memory_order_relaxed);
+              while (limit > cap &&
+                     !this->grow_limit.compare_exchange_weak (
+                       limit, cap, std::memory_order_acq_rel,
+                       std::memory_order_relaxed))
+                ;
+
+              vp->spare.store (np, std::memory_order_release);
             }
         }
 
-      s.set (nullptr, 0);
+      size_t start, end;
+      if (!detail::ht_claim (vp->fill_claimed, np->entries,
+                             detail::HT_FILL_CHUNK, start, end))
+        return (false);
 
-      np->nelems.store (nelem, std::memory_order_relaxed);
-      this->grow_limit.store ((intptr_t)(np->entries * this->loadf) -
-                              nelem, std::memory_order_relaxed);
-      std::atomic_thread_fence (std::memory_order_release);
+      np->fill (start, end, key_traits::FREE, val_traits::FREE);
+      if (vp->filled.fetch_add (end - start, std::memory_order_acq_rel) +
+          (end - start) == np->entries)
+        {
+          vp->next.store (np, std::memory_order_release);
+
+          /*
+           * Only the live entries count against the new limit. Insertions
+           * that are still in flight may be left out, but the load factor
+           * leaves more than enough room for them.
+           */
+          this->grow_limit.store (
+            detail::compute_fsize (this->loadf, np->entries) -
+            (intptr_t)vp->nelems.load (std::memory_order_relaxed),
+            std::memory_order_release);
+        }
 
-      /*
-       * At this point, another thread may decrement the growth limit
-       * from the wrong vector. That's fine, it just means we'll move
-       * the table sooner than necessary.
-       */
-      this->vec = np;
-      finalize (old);
+      return (true);
     }
 
-  uintptr_t _Find (const KeyT& key) const
+  /*
+   * Called after an erasure, to move to a smaller vector if needed. Nothing
+   * guarantees that more writes will follow, and until the migration is
+   * done, lookups may have to visit both vectors and neither can be freed,
+   * so the thread that starts it sees it through. Unless the table was
+   * created larger than needed, the number of elements dropped from half
+   * the limit to under the shrink factor, so the cost is amortized over
+   * all those erasures.
+   */
+  void _Shrink (detail::ht_vector<Nalloc> *vp)
+    {
+      if (vp->spare.load (std::memory_order_relaxed))
+        this->_Prepare (vp);
+      else if (vp->pidx > 0 && vp == this->vec)
+        {
+          size_t live = vp->nelems.load (std::memory_order_relaxed);
+          if (live < (size_t)detail::compute_fsize (this->shrinkf,
+                                                    vp->entries) &&
+              this->_Target_pidx (live) < vp->pidx &&
+              this->_Prepare (vp, true))
+            this->_Finish_migration ();
+        }
+    }
+
+  // Called when the growth limit is reached.
+  void _Rehash ()
     {
       auto vp = this->vec;
-      size_t idx = this->_Probe (key, vp, false);
-      return (idx == (size_t)-1 ?
-              val_traits::DELT :
-              vp->data[idx + 1] & ~val_traits::XBIT);
+      bool progress = vp->next.load (std::memory_order_acquire) ?
+                      this->_Migrate_chunk (vp) : this->_Prepare (vp);
+
+      if (!progress)
+        // Every chunk has been claimed; wait for the other threads.
+        xatomic_spin_nop ();
+    }
+
+  // Help with the pending preparation and migration until they're done.
+  detail::ht_vector<Nalloc>* _Finish_migration ()
+    {
+      domain_guard<Domain> g;
+
+      while (true)
+        {
+          auto vp = this->vec;
+          if (vp->next.load (std::memory_order_acquire))
+            {
+              if (!this->_Migrate_chunk (vp))
+                xatomic_spin_nop ();
+            }
+          else if (!vp->spare.load (std::memory_order_acquire))
+            return (vp);
+          else if (!this->_Prepare (vp))
+            xatomic_spin_nop ();
+        }
+    }
+
+  uintptr_t _Find (const KeyT& key) const
+    {
+      for (auto vp = this->vec ; ; )
+        {
+          size_t idx = this->_Probe (key, vp, false);
+          if (idx != (size_t)-1)
+            { // A frozen value remains valid until its entry is moved.
+              uintptr_t val = vp->data[idx + 1] & ~val_traits::XBIT;
+              if (val != val_traits::FREE && val != val_traits::DELT)
+                return (val);
+            }
+
+          // The key may have been moved or added to the next vector.
+          vp = vp->next.load (std::memory_order_acquire);
+          if (!vp)
+            return (val_traits::DELT);
+        }
     }
 
   std::optional<ValT> find (const KeyT& key) const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       uintptr_t val = this->_Find (key);
       return (val == val_traits::DELT ?
               std::nullopt :
@@ -544,14 +869,14 @@ struct hash_table
 
   ValT find (const KeyT& key, const ValT& dfl) const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       uintptr_t val = this->_Find (key);
       return (val == val_traits::DELT ? dfl : val_traits::get (val));
     }
 
   bool contains (const KeyT& key) const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       return (this->_Find (key) != val_traits::DELT);
     }
 
@@ -575,15 +900,21 @@ struct hash_table
   bool _Upsert (const KeyT& key, Fn f, Args... args)
     {
       detail::ht_key_inserter<key_traits> ki;
-      cs_guard g;
+      domain_guard<Domain> g;
 
-      while (true)
+      for (auto vp = this->vec ; ; )
         {
-          auto vp = this->vec;
+          if (vp->next.load (std::memory_order_acquire))
+            // Do our share of the migration before proceeding.
+            this->_Migrate_chunk (vp);
+
           uintptr_t *ep = vp->data;
           bool found;
           size_t idx = this->_Probe (key, vp, true, found);
 
+          // Reload this after probing, since entries may have been moved.
+          auto np = vp->next.load (std::memory_order_acquire);
+
           if (!found)
             {
               uintptr_t tmp = ep[idx + 1];
@@ -601,6 +932,38 @@ struct hash_table
                   f.free (v);
                   continue;
                 }
+
+              // The entry is being moved or erased - retry.
+              xatomic_spin_nop ();
+              vp = this->vec;
+              continue;
+            }
+          else if (np)
+            {
+              /*
+               * The key isn't in this vector. Seal the free slot so that
+               * no insertion can land there after we've looked, and go on
+               * with the next vector.
+               */
+              uintptr_t tmp = ep[idx + 1];
+              if (tmp == (val_traits::FREE | val_traits::XBIT) ||
+                  (tmp == val_traits::FREE &&
+                   xatomic_cas_bool (ep + idx + 1, tmp,
+                                     tmp | val_traits::XBIT)))
+                vp = np;
+
+              continue;
+            }
+          else if (ep[idx + 1] != val_traits::FREE)
+            {
+              /*
+               * The slot was frozen by an assignment that's replacing the
+               * vector. Don't take anything from the new vector's limit
+               * until we're working on it.
+               */
+              xatomic_spin_nop ();
+              vp = this->vec;
+              continue;
             }
           else if (this->_Decr_limit ())
             {
@@ -620,21 +983,39 @@ struct hash_table
               if (xatomic_dcas_bool (&ep[idx], key_traits::FREE,
                                      val_traits::FREE, ki.slot, v))
 #else
-              if (xatomic_cas_bool (ep + idx + 0, key_traits::FREE, ki.slot) &&
-                  xatomic_cas_bool (ep + idx + 1, val_traits::FREE, v))
+              bool ok = xatomic_cas_bool (ep + idx + 0,
+                                          key_traits::FREE, ki.slot);
+              if (ok && !(ok = xatomic_cas_bool (ep + idx + 1,
+                                                 val_traits::FREE, v)))
+                { // The slot was sealed, but readers may see the key.
+                  ep[idx] = key_traits::DELT;
+                  key_traits::destroy (ki.slot);
+                  ki.clear ();
+                }
+
+              if (ok)
 #endif
                 {
                   ki.clear ();   // Take ownership of the key.
                   vp->nelems.fetch_add (1, std::memory_order_acq_rel);
+
+                  // Get the next vector ready well before this one is full.
+                  if (this->grow_limit.load (std::memory_order_relaxed) <
+                      (intptr_t)(vp->entries >> 4))
+                    this->_Prepare (vp);
+
                   return (found);
                 }
 
+              // The slot may have been taken, sealed or frozen.
               f.free (v);
+              vp = this->vec;
               continue;
             }
 
-          // The table was being rehashed - retry.
+          // The vector is full - Migrate to a bigger one and retry.
           this->_Rehash ();
+          vp = this->vec;
         }
     }
 
@@ -662,42 +1043,55 @@ struct hash_table
 
   bool _Erase (const KeyT& key, std::optional<ValT> *outp = nullptr)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
 
-      while (true)
+      for (auto vp = this->vec ; ; )
         {
-          auto vp = this->vec;
+          if (vp->next.load (std::memory_order_acquire))
+            this->_Migrate_chunk (vp);
+
           uintptr_t *ep = vp->data;
           size_t idx = this->_Probe (key, vp, false);
+          auto np = vp->next.load (std::memory_order_acquire);
 
-          if (idx == (size_t)-1)
-            return (false);
-
-          uintptr_t oldk = ep[idx], oldv = ep[idx + 1];
-
-          if ((oldv & val_traits::XBIT) == 0)
+          if (idx != (size_t)-1)
             {
-              if (oldk == key_traits::DELT || oldk == key_traits::FREE ||
-                  oldv == val_traits::DELT)
-                return (false);
-              else if (!xatomic_cas_bool (ep + idx + 1,
-                                          oldv, val_traits::DELT))
-                continue;
+              uintptr_t oldk = ep[idx], oldv = ep[idx + 1];
+
+              if (oldv & val_traits::XBIT)
+                {
+                  oldv &= ~val_traits::XBIT;
+                  if (oldv != val_traits::FREE && oldv != val_traits::DELT)
+                    { // The entry is being moved - retry.
+                      xatomic_spin_nop ();
+                      vp = this->vec;
+                      continue;
+                    }
+                }
+              else if (oldk != key_traits::DELT && oldk != key_traits::FREE &&
+                       oldv != val_traits::DELT && oldv != val_traits::FREE)
+                {
+                  if (!xatomic_cas_bool (ep + idx + 1, oldv, val_traits::DELT))
+                    continue;
 
-              vp->nelems.fetch_sub (1, std::memory_order_acq_rel);
-              // Safe to set the key without atomic ops.
-              ep[idx] = key_traits::DELT;
-              key_traits::destroy (oldk);
-              val_traits::destroy (oldv);
+                  vp->nelems.fetch_sub (1, std::memory_order_acq_rel);
+                  // Safe to set the key without atomic ops.
+                  ep[idx] = key_traits::DELT;
+                  key_traits::destroy (oldk);
+                  val_traits::destroy (oldv);
 
-              if (outp)
-                *outp = val_traits::get (oldv);
+                  if (outp)
+                    *outp = val_traits::get (oldv);
 
-              return (true);
+                  this->_Shrink (vp);
+                  return (true);
+                }
             }
 
-          // The table was being rehashed - retry.
-          this->_Rehash ();
+          if (!np)
+            return (false);
+
+          vp = np;
         }
     }
 
@@ -713,9 +1107,9 @@ struct hash_table
       return (ret);
     }
 
-  struct iterator : public detail::ht_iter<key_traits, val_traits>
+  struct iterator : public detail::ht_iter<key_traits, val_traits, Domain>
     {
-      typedef detail::ht_iter<key_traits, val_traits> base_type;
+      typedef detail::ht_iter<key_traits, val_traits, Domain> base_type;
 
       iterator () : base_type ()
         {
@@ -723,7 +1117,12 @@ struct hash_table
 
       iterator (const self_type& self) : base_type ()
         {
-          this->_Init (self.vec->data, self.vec->size ());
+          /*
+           * Finish any pending migration, so that every entry is seen
+           * exactly once. This is cheap compared to a full iteration.
+           */
+          auto vp = const_cast<self_type&> (self)._Finish_migration ();
+          this->_Init (vp->data, vp->size ());
         }
 
       iterator (const iterator& right) : base_type (right)
@@ -789,7 +1188,7 @@ struct hash_table
     {
       // First step: Lock the table.
       this->lock.acquire ();
-      auto prev = this->vec;
+      auto prev = this->_Finish_migration ();
 
       // Second step: Finalize every valid key/value pair.
       for (size_t i = detail::table_idx (0) + 1; i < prev->size (); i += 2)
@@ -808,12 +1207,13 @@ struct hash_table
 
       this->vec = nv;
       this->lock.release ();
-      finalize (prev);
+      Domain::finalize (prev);
     }
 
   void clear ()
     {
       this->lock.acquire ();
+      this->_Finish_migration ();
       this->grow_limit.store (0, std::memory_order_release);
 
       for (size_t i = detail::table_idx (0); i < this->vec->size (); i += 2)
@@ -842,6 +1242,7 @@ struct hash_table
   void assign (Iter first, Iter last)
     {
       self_type tmp (first, last, this->loadf, this->eqfn, this->hashfn);
+      tmp._Finish_migration ();
       this->_Assign_vector (tmp.vec,
                             tmp.grow_limit.load (std::memory_order_relaxed));
       tmp.vec = nullptr;
@@ -861,9 +1262,11 @@ struct hash_table
 
   self_type& operator= (self_type&& right) noexcept
     {
+      right._Finish_migration ();
       this->_Assign_vector (right.vec,
                             right.grow_limit.load (std::memory_order_relaxed));
       this->loadf = right.loadf;
+      this->shrinkf = right.shrinkf;
       right.vec = nullptr;
       return (*this);
     }
@@ -873,8 +1276,11 @@ struct hash_table
       if (this == &right)
         return;
 
-      detail::ht_sentry s1 (&this->lock, ~val_traits::XBIT);
-      detail::ht_sentry s2 (&right.lock, ~val_traits::XBIT);
+      detail::ht_sentry<Lock> s1 (&this->lock);
+      detail::ht_sentry<Lock> s2 (&right.lock);
+
+      this->_Finish_migration ();
+      right._Finish_migration ();
 
       // Prevent further insertions (still allows deletions).
       this->grow_limit.store (0, std::memory_order_release);
@@ -884,6 +1290,7 @@ struct hash_table
       std::swap (this->eqfn, right.eqfn);
       std::swap (this->hashfn, right.hashfn);
       std::swap (this->loadf, right.loadf);
+      std::swap (this->shrinkf, right.shrinkf);
 
       this->grow_limit.store (detail::compute_fsize (this->loadf,
                                                      this->vec->entries),
@@ -893,17 +1300,19 @@ struct hash_table
                               std::memory_order_release);
     }
 
-  template <typename K2, typename V2, typename E2,
-            typename H2, typename A2>
-  bool operator== (const hash_table<K2, V2, E2, H2, A2>& right) const
+  template <typename K2, typename V2, typename E2, typename H2,
+            typename A2, typename D2, typename L2, typename S2>
+  bool operator== (const hash_table<K2, V2, E2, H2,
+                                    A2, D2, L2, S2>& right) const
     {
       return (detail::sequence_eq (this->cbegin (), this->cend (),
                                    right.cbegin (), right.cend ()));
     }
 
-  template <typename K2, typename V2, typename E2,
-            typename H2, typename A2>
-  bool operator!= (const hash_table<K2, V2, E2, H2, A2>& right) const
+  template <typename K2, typename V2, typename E2, typename H2,
+            typename A2, typename D2, typename L2, typename S2>
+  bool operator!= (const hash_table<K2, V2, E2, H2,
+                                    A2, D2, L2, S2>& right) const
     {
       return (!(*this == right));
     }
@@ -913,6 +1322,7 @@ struct hash_table
       if (!this->vec)
         return;
 
+      this->_Finish_migration ();
       for (size_t i = detail::table_idx (0); i < this->vec->size (); i += 2)
         {
           uintptr_t k = this->vec->data[i] & ~key_traits::XBIT;
@@ -933,10 +1343,12 @@ struct hash_table
 namespace std
 {
 
-template <typename KeyT, typename ValT, typename EqFn,
-          typename HashFn, typename Alloc>
-void swap (xrcu::hash_table<KeyT, ValT, EqFn, HashFn, Alloc>& left,
-           xrcu::hash_table<KeyT, ValT, EqFn, HashFn, Alloc>& right)
+template <typename KeyT, typename ValT, typename EqFn, typename HashFn,
+          typename Alloc, typename Domain, typename Lock, typename Sizing>
+void swap (xrcu::hash_table<KeyT, ValT, EqFn, HashFn,
+                            Alloc, Domain, Lock, Sizing>& left,
+           xrcu::hash_table<KeyT, ValT, EqFn, HashFn,
+                            Alloc, Domain, Lock, Sizing>& right)
 {
   left.swap (right);
 }
@@ -39,6 +39,68 @@ struct lwlock
   void operator= (const lwlock&) = delete;
 };
 
+/* Queue-based lock (CLH). Waiters form a queue and each one waits on the node
+ * of its predecessor, so they don't all hammer the same word. Ownership
+ * is handed off in FIFO order. This is better than the above under heavy
+ * contention, but a bit more expensive when it's uncontended. */
+struct clh_lock
+{
+  uintptr_t tail;
+  uintptr_t owner = 0;
+
+  void acquire ();
+  void release ();
+
+  clh_lock ();
+  ~clh_lock ();
+
+  clh_lock (const clh_lock&) = delete;
+  void operator= (const clh_lock&) = delete;
+};
+
+/* Reader-writer counterpart to 'lwlock', with the same footprint. Readers
+ * only need an atomic increment when there are no writers, and writers are
+ * preferred: Once one is waiting, new readers are held back. In the RCU-biased
+ * mode, readers don't write to the lock at all, but enter a critical section
+ * instead, and writers wait for them with a call to 'xrcu::sync'. That makes
+ * reading much cheaper and writing much more expensive. */
+struct rwlwlock
+{
+  uintptr_t state;
+
+  /* Returns false if the lock couldn't be taken because it's RCU-biased and
+   * the caller is in a critical section, which would make it wait for
+   * itself. Always returns true otherwise. */
+  bool acquire ();
+  void release ();
+  void acquire_shared ();
+  void release_shared ();
+
+  // Allow use with std::unique_lock and std::shared_lock.
+  // Throws std::system_error when 'acquire' fails.
+  void lock ();
+
+  void unlock ()
+    {
+      this->release ();
+    }
+
+  void lock_shared ()
+    {
+      this->acquire_shared ();
+    }
+
+  void unlock_shared ()
+    {
+      this->release_shared ();
+    }
+
+  explicit rwlwlock (bool rcu_biased = false);
+
+  rwlwlock (const rwlwlock&) = delete;
+  void operator= (const rwlwlock&) = delete;
+};
+
 }
 
 #endif
@@ -20,6 +20,9 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
 
 namespace xrcu
 {
@@ -44,6 +47,74 @@ void dealloc_uptrs (void *base, void *end)
   Alloc().deallocate ((uintptr_t *)base, total / sizeof (uintptr_t));
 }
 
+namespace detail
+{
+
+// Allocate and free blocks of SIZE bytes, caching them in the calling thread.
+extern void* slab_alloc (size_t size);
+extern void slab_free (void *ptr, size_t size);
+
+} // namespace detail
+
+/*
+ * Allocator that keeps freed blocks in per-thread magazines, so that memory
+ * released by objects after a grace period is reused by the next allocation
+ * instead of going back to the system allocator. Small blocks are grouped in
+ * size classes; larger ones are allocated directly.
+ */
+template <typename T>
+struct rcu_slab
+{
+  typedef std::true_type is_always_equal;
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  rcu_slab () noexcept
+    {
+    }
+
+  template <typename U>
+  rcu_slab (const rcu_slab<U>&) noexcept
+    {
+    }
+
+  T* allocate (size_t n, const void * = nullptr)
+    {
+      if (n > SIZE_MAX / sizeof (T))
+        throw std::bad_array_new_length ();
+
+      if constexpr (alignof (T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+        return (std::allocator<T>().allocate (n));
+      else
+        return ((T *)detail::slab_alloc (n * sizeof (T)));
+    }
+
+  void deallocate (T *ptr, size_t n)
+    {
+      if constexpr (alignof (T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+        std::allocator<T>().deallocate (ptr, n);
+      else
+        detail::slab_free (ptr, n * sizeof (T));
+    }
+};
+
+template <typename T, typename U>
+bool operator== (const rcu_slab<T>&, const rcu_slab<U>&)
+{
+  return (true);
+}
+
+template <typename T, typename U>
+bool operator!= (const rcu_slab<T>&, const rcu_slab<U>&)
+{
+  return (false);
+}
+
 } // namespace xrcu
 
 #endif
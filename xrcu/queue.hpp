@@ -80,8 +80,6 @@ struct alignas (uintptr_t) q_base : public finalizable
       return (this->ptrs[idx - 1]);
     }
 
-  static void replace (std::atomic<q_base *>&, q_base *,
-                       q_base *, uintptr_t);
   static void clear (std::atomic<q_base *>&, q_base *,
                      q_base *, uintptr_t);
 
@@ -93,12 +91,13 @@ struct alignas (uintptr_t) q_base : public finalizable
 
 } // namespace detail
 
-template <typename T, typename Alloc = std::allocator<T>>
+template <typename T, typename Alloc = std::allocator<T>,
+          typename Domain = default_domain>
 struct queue
 {
   typedef detail::wrapped_traits<(sizeof (T) < sizeof (uintptr_t) &&
                                   std::is_integral<T>::value),
-                                  T, Alloc> val_traits;
+                                  T, Alloc, Domain> val_traits;
 
   using Nalloc = typename std::allocator_traits<Alloc>::template
                           rebind_alloc<uintptr_t>;
@@ -126,6 +125,12 @@ struct queue
         {
           dealloc_uptrs<Nalloc> (this, this->ptrs + this->cap + 1);
         }
+
+      size_t fin_size () const
+        {
+          return ((const char *)(this->ptrs + this->cap + 1) -
+                  (const char *)this);
+        }
     };
 
   std::atomic<detail::q_base *> impl;
@@ -158,7 +163,7 @@ struct queue
       this->impl.store (qdp, std::memory_order_relaxed);
     }
 
-  struct iterator : public cs_guard
+  struct iterator : public domain_guard<Domain>
     {
       const q_data *qdp;
       size_t idx;
@@ -294,11 +299,12 @@ struct queue
       this->_Init (first, last, typename std::is_integral<T1>::type ());
     }
 
-  queue (const queue<T, Alloc>& right) : queue (right.begin (), right.end ())
+  queue (const queue<T, Alloc, Domain>& right) :
+      queue (right.begin (), right.end ())
     {
     }
 
-  queue (queue<T, Alloc>&& right) noexcept
+  queue (queue<T, Alloc, Domain>&& right) noexcept
     {
       this->_Set_data (right._Data ());
       right._Set_data (nullptr);
@@ -360,7 +366,7 @@ struct queue
 
       *outp++ = elem;
       nq->wr_idx.store (outp - nq->ptrs, std::memory_order_relaxed);
-      finalize (qdp);
+      Domain::finalize (qdp);
 
       this->_Set_data (nq);
       return (true);
@@ -379,20 +385,20 @@ struct queue
  
   void push (const T& elem)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       this->_Push (val_traits::make (elem));
     }
 
   template <typename ...Args>
   void emplace (Args&& ...args)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       this->_Push (val_traits::make (std::forward<Args>(args)...));
     }
 
   std::optional<T> pop ()
     {
-      cs_guard g;
+      domain_guard<Domain> g;
 
       while (true)
         {
@@ -415,7 +421,7 @@ struct queue
 
   std::optional<T> front () const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       while (true)
         {
           uintptr_t rv = this->_Data()->front () & ~val_traits::XBIT;
@@ -432,7 +438,7 @@ struct queue
 
   std::optional<T> back () const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       while (true)
         {
           uintptr_t rv = this->_Data()->back () & ~val_traits::XBIT;
@@ -449,7 +455,7 @@ struct queue
 
   size_t size () const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       return (this->_Data()->size ());
     }
 
@@ -465,7 +471,7 @@ struct queue
 
   iterator begin () const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       auto qdp = this->_Data ();
       return (iterator (qdp, qdp->_Rdidx ()));
     }
@@ -524,16 +530,23 @@ struct queue
         }
     }
 
+  static void _Replace (std::atomic<detail::q_base *>& ptr,
+                        detail::q_base *old, detail::q_base *nq, uintptr_t)
+    {
+      Domain::finalize (old);
+      ptr.store (nq, std::memory_order_relaxed);
+    }
+
   void _Assign (q_data *nq)
     {
-      this->_Call_cb (nq, 0, detail::q_base::replace);
+      this->_Call_cb (nq, 0, _Replace);
     }
 
   template <typename T1, typename T2>
   void assign (T1 first, T2 last)
     {
-      cs_guard g;
-      auto tmp = queue<T, Alloc> (first, last);
+      domain_guard<Domain> g;
+      auto tmp = queue<T, Alloc, Domain> (first, last);
       this->_Assign (tmp._Data ());
       tmp._Set_data (nullptr);
     }
@@ -543,56 +556,56 @@ struct queue
       this->assign (lst.begin (), lst.end ());
     }
 
-  queue<T, Alloc>& operator= (const queue<T, Alloc>& right)
+  queue<T, Alloc, Domain>& operator= (const queue<T, Alloc, Domain>& right)
     {
       if (this != &right)
         this->assign (right.begin (), right.end ());
       return (*this);
     }
 
-  template <typename T2, typename A2>
-  bool operator== (const queue<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator== (const queue<T2, A2, D2>& right) const
     {
       return (detail::sequence_eq (this->cbegin (), this->cend (),
                                    right.cbegin (), right.cend ()));
     }
 
-  template <typename T2, typename A2>
-  bool operator!= (const queue<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator!= (const queue<T2, A2, D2>& right) const
     {
       return (!(*this == right));
     }
 
-  template <typename T2, typename A2>
-  bool operator< (const queue<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator< (const queue<T2, A2, D2>& right) const
     {
       return (detail::sequence_lt (this->cbegin (), this->cend (),
                                    right.cbegin (), right.cend ()));
     }
 
-  template <typename T2, typename A2>
-  bool operator> (const queue<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator> (const queue<T2, A2, D2>& right) const
     {
       return (right < *this);
     }
 
-  template <typename T2, typename A2>
-  bool operator<= (const queue<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator<= (const queue<T2, A2, D2>& right) const
     {
       return (!(right < *this));
     }
 
-  template <typename T2, typename A2>
-  bool operator>= (const queue<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator>= (const queue<T2, A2, D2>& right) const
     {
       return (!(*this < right));
     }
 
-  queue<T, Alloc>& operator= (queue<T, Alloc>&& right) noexcept
+  queue<T, Alloc, Domain>& operator= (queue<T, Alloc, Domain>&& right) noexcept
     {
       auto prev = this->impl.exchange (right._Data (),
                                        std::memory_order_acq_rel);
-      finalize (prev);
+      Domain::finalize (prev);
       right._Set_data (nullptr);
       return (*this);
     }
@@ -611,7 +624,7 @@ struct queue
 
   void clear ()
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       this->_Call_cb (nullptr, val_traits::FREE, detail::q_base::clear);
     }
 
@@ -633,7 +646,7 @@ struct queue
         }
     }
 
-  void swap (queue<T, Alloc>& right)
+  void swap (queue<T, Alloc, Domain>& right)
     {
       if (this == &right)
         return;
@@ -671,8 +684,9 @@ struct queue
 namespace std
 {
 
-template <typename T, typename Alloc>
-void swap (xrcu::queue<T, Alloc>& left, xrcu::queue<T, Alloc>& right)
+template <typename T, typename Alloc, typename Domain>
+void swap (xrcu::queue<T, Alloc, Domain>& left,
+           xrcu::queue<T, Alloc, Domain>& right)
 {
   left.swap (right);
 }
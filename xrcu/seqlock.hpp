@@ -0,0 +1,316 @@
+/* Declarations for sequence locks.
+
+   This file is part of xrcu.
+
+   xrcu is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef __XRCU_SEQLOCK_HPP__
+#define __XRCU_SEQLOCK_HPP__   1
+
+#include "lwlock.hpp"
+#include "xatomic.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+namespace xrcu
+{
+
+namespace detail
+{
+
+template <typename T, size_t N>
+struct seq_words
+{
+  static constexpr size_t NWORDS = N;
+
+  static void pack (uintptr_t *out, const T& val)
+    {
+      for (size_t i = 0; i < NWORDS; ++i)
+        out[i] = 0;
+
+      std::memcpy (out, &val, sizeof (T));
+    }
+
+  // T need not be default constructible, so copy into raw storage.
+  static T unpack (const uintptr_t *in)
+    {
+      alignas (T) unsigned char mem[sizeof (T)];
+      std::memcpy (mem, in, sizeof (T));
+      return (*std::launder ((T *)mem));
+    }
+};
+
+/*
+ * Classic sequence lock: The counter is odd while a write is in progress.
+ * Readers copy the words and retry if the counter changed in the meantime.
+ * Writers are serialized with a lightweight lock.
+ */
+template <typename T>
+struct seq_locked :
+  public seq_words<T, (sizeof (T) + sizeof (uintptr_t) - 1) /
+                      sizeof (uintptr_t)>
+{
+  typedef seq_words<T, (sizeof (T) + sizeof (uintptr_t) - 1) /
+                       sizeof (uintptr_t)> base_type;
+
+  std::atomic<uintptr_t> seq { 0 };
+  std::atomic<uintptr_t> words[base_type::NWORDS];
+  lwlock lock;
+
+  void _Read (uintptr_t *out) const
+    {
+      while (true)
+        {
+          uintptr_t s1 = this->seq.load (std::memory_order_acquire);
+          if (s1 & 1)
+            {
+              xatomic_spin_nop ();
+              continue;
+            }
+
+          for (size_t i = 0; i < base_type::NWORDS; ++i)
+            out[i] = this->words[i].load (std::memory_order_relaxed);
+
+          std::atomic_thread_fence (std::memory_order_acquire);
+          if (this->seq.load (std::memory_order_relaxed) == s1)
+            return;
+        }
+    }
+
+  // Must be called with the lock held.
+  void _Write (const uintptr_t *in)
+    {
+      uintptr_t s = this->seq.load (std::memory_order_relaxed);
+      this->seq.store (s + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence (std::memory_order_release);
+
+      for (size_t i = 0; i < base_type::NWORDS; ++i)
+        this->words[i].store (in[i], std::memory_order_relaxed);
+
+      this->seq.store (s + 2, std::memory_order_release);
+    }
+
+  template <typename Fn>
+  void _Modify (Fn fn)
+    {
+      uintptr_t buf[base_type::NWORDS];
+      this->lock.acquire ();
+
+      // We're the only writer, so there's no need to validate the copy.
+      for (size_t i = 0; i < base_type::NWORDS; ++i)
+        buf[i] = this->words[i].load (std::memory_order_relaxed);
+
+      try
+        {
+          fn (buf);
+        }
+      catch (...)
+        {
+          this->lock.release ();
+          throw;
+        }
+
+      this->_Write (buf);
+      this->lock.release ();
+    }
+};
+
+#ifdef XRCU_HAVE_XATOMIC_DCAS
+
+/*
+ * Lock-free variant for values that fit in two words. Writers replace both
+ * of them at once with a double-width CAS, so they never have to wait for
+ * each other. Since readers can't load both words atomically, the counter
+ * tracks the number of writers in flight in its low bits, and a version in
+ * the rest. A read is valid if no writer was active and the version didn't
+ * change during it.
+ */
+template <typename T>
+struct seq_dcas : public seq_words<T, 2>
+{
+  typedef seq_words<T, 2> base_type;
+
+  static const uintptr_t SEQ_VERSION = (uintptr_t)1 << 16;
+  static const uintptr_t SEQ_ACTIVE = SEQ_VERSION - 1;
+
+  alignas (2 * sizeof (uintptr_t)) uintptr_t words[2];
+  std::atomic<uintptr_t> seq { 0 };
+
+  void _Read (uintptr_t *out) const
+    {
+      while (true)
+        {
+          uintptr_t s1 = this->seq.load (std::memory_order_acquire);
+          if (s1 & SEQ_ACTIVE)
+            {
+              xatomic_spin_nop ();
+              continue;
+            }
+
+          out[0] = __atomic_load_n (&this->words[0], __ATOMIC_RELAXED);
+          out[1] = __atomic_load_n (&this->words[1], __ATOMIC_RELAXED);
+
+          std::atomic_thread_fence (std::memory_order_acquire);
+          if (this->seq.load (std::memory_order_relaxed) == s1)
+            return;
+        }
+    }
+
+  template <typename Fn>
+  void _Modify (Fn fn)
+    {
+      this->seq.fetch_add (1, std::memory_order_acq_rel);
+      // Readers that see our update must also see that we're active.
+      std::atomic_thread_fence (std::memory_order_release);
+
+      try
+        {
+          while (true)
+            {
+              uintptr_t lo = __atomic_load_n (&this->words[0],
+                                              __ATOMIC_ACQUIRE);
+              uintptr_t hi = __atomic_load_n (&this->words[1],
+                                              __ATOMIC_ACQUIRE);
+              uintptr_t buf[2] = { lo, hi };
+
+              // A torn copy simply makes the CAS fail.
+              fn (buf);
+              if (xatomic_dcas_bool (this->words, lo, hi, buf[0], buf[1]))
+                break;
+
+              xatomic_spin_nop ();
+            }
+        }
+      catch (...)
+        {
+          this->seq.fetch_add (SEQ_VERSION - 1, std::memory_order_release);
+          throw;
+        }
+
+      this->seq.fetch_add (SEQ_VERSION - 1, std::memory_order_release);
+    }
+};
+
+template <typename T>
+struct seq_dcas_impl
+{
+  typedef typename std::conditional<(sizeof (T) <= 2 * sizeof (uintptr_t)),
+    seq_dcas<T>, seq_locked<T>>::type type;
+};
+
+#else
+
+template <typename T>
+struct seq_dcas_impl
+{
+  typedef seq_locked<T> type;
+};
+
+#endif
+
+} // namespace detail
+
+/*
+ * Sequence lock that protects a small, trivially copyable value. Reads
+ * never write to shared memory, and updates don't allocate anything,
+ * which makes it a better fit than RCU-managed pointers for things like
+ * statistics snapshots or pairs of timestamps.
+ */
+template <typename T, typename Impl = detail::seq_locked<T>>
+struct seqlock : public Impl
+{
+  static_assert (std::is_trivially_copyable<T>::value,
+                 "seqlock values must be trivially copyable");
+
+  typedef T value_type;
+
+  template <typename U = T, typename =
+    typename std::enable_if<std::is_default_constructible<U>::value>::type>
+  seqlock () : seqlock (U ())
+    {
+    }
+
+  explicit seqlock (const T& val)
+    {
+      uintptr_t buf[Impl::NWORDS];
+      Impl::pack (buf, val);
+      for (size_t i = 0; i < Impl::NWORDS; ++i)
+        this->words[i] = buf[i];
+    }
+
+  seqlock (const seqlock&) = delete;
+  void operator= (const seqlock&) = delete;
+
+  // Get a consistent copy of the value.
+  T load () const
+    {
+      uintptr_t buf[Impl::NWORDS];
+      this->_Read (buf);
+      return (Impl::unpack (buf));
+    }
+
+  void store (const T& val)
+    {
+      this->_Modify ([&val] (uintptr_t *buf)
+        {
+          Impl::pack (buf, val);
+        });
+    }
+
+  /*
+   * Replace the value with the result of calling FN with the current value
+   * and ARGS. Returns the new value. FN may be called more than once.
+   */
+  template <typename Fn, typename ...Args>
+  T update (Fn fn, Args... args)
+    {
+      uintptr_t out[Impl::NWORDS];
+      this->_Modify ([&] (uintptr_t *buf)
+        {
+          Impl::pack (buf, fn (Impl::unpack (buf), args...));
+          std::memcpy (out, buf, sizeof (out));
+        });
+
+      return (Impl::unpack (out));
+    }
+
+  T exchange (const T& val)
+    {
+      uintptr_t out[Impl::NWORDS];
+      this->_Modify ([&] (uintptr_t *buf)
+        {
+          std::memcpy (out, buf, sizeof (out));
+          Impl::pack (buf, val);
+        });
+
+      return (Impl::unpack (out));
+    }
+};
+
+/*
+ * Variant in which writers don't take a lock, but use a double-width CAS
+ * instead. This makes uncontended updates slightly more expensive, but
+ * a preempted writer never holds up the others. Falls back to the above
+ * for larger values, or when the platform has no double-width CAS.
+ */
+template <typename T>
+using dcas_seqlock = seqlock<T, typename detail::seq_dcas_impl<T>::type>;
+
+} // namespace xrcu
+
+#endif
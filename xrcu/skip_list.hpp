@@ -42,7 +42,12 @@ namespace detail
 {
 
 static constexpr uintptr_t SL_XBIT = 1;
-static constexpr unsigned int SL_MAX_DEPTH = 24;
+static constexpr unsigned int SL_MAX_DEPTH = 32;
+/*
+ * Default probability that a node reaches the next level. This is 1/e,
+ * which minimizes the expected number of nodes visited in a lookup.
+ */
+static constexpr double SL_LEVEL_PROB = 0.36787944117144233;
 
 static constexpr int SL_UNLINK_SKIP = -1;
 static constexpr int SL_UNLINK_NONE = 0;
@@ -78,19 +83,39 @@ struct alignas (uintptr_t) sl_node_impl : public finalizable
       xatomic_add (lenp, off + off);
     }
 
+  // Convert a probability into a threshold for 'rand_lvl'.
+  static uint64_t lvl_threshold (double prob)
+    {
+      if (!(prob > 0))
+        return (0);
+      else if (prob >= 1)
+        return (~(uint64_t)0);
+
+      return ((uint64_t)(prob * 18446744073709551616.0));
+    }
+
+  /*
+   * Compute the level for a new node. Every level past the first one is
+   * reached with a probability of 'thr / 2^64'. The high water mark only
+   * grows by one at a time, so that a few unlucky nodes don't make every
+   * lookup start too high.
+   */
   static unsigned int
-  rand_lvl (std::atomic<size_t>& hw)
+  rand_lvl (std::atomic<size_t>& hw, uint64_t thr, unsigned int maxlvl)
     {
-      size_t lvl = ctz (xrand ()) * 2 / 3;
+      size_t lvl = 1;
 
-      if (lvl == 0)
+      while (lvl < maxlvl && xrand64 () < thr)
+        ++lvl;
+
+      if (lvl == 1)
         return (1);
       while (true)
         {
           auto prev = hw.load (std::memory_order_relaxed);
           if (lvl <= prev)
             return (lvl);
-          else if (prev == SL_MAX_DEPTH ||
+          else if (prev >= maxlvl ||
                    hw.compare_exchange_weak (prev, prev + 1,
                                              std::memory_order_acq_rel,
                                              std::memory_order_relaxed))
@@ -123,6 +148,11 @@ struct alignas (uintptr_t) sl_node_base : public sl_node_impl
     {
       dealloc_uptrs<Alloc> (this, this->next + this->nlvl);
     }
+
+  size_t fin_size () const
+    {
+      return ((const char *)(this->next + this->nlvl) - (const char *)this);
+    }
 };
 
 template <typename T, typename Alloc>
@@ -185,7 +215,8 @@ init_preds_succs (uintptr_t *p1, uintptr_t *p2)
 } // namespace detail
 
 template <typename T, typename Cmp = std::less<T>,
-          typename Alloc = std::allocator<T>>
+          typename Alloc = std::allocator<T>,
+          typename Domain = default_domain>
 struct skip_list
 {
   using Nalloc = typename std::allocator_traits<Alloc>::template
@@ -194,6 +225,7 @@ struct skip_list
   std::atomic<detail::sl_node_base<Nalloc> *> head;
   Cmp cmpfn;
   unsigned int max_depth;
+  uint64_t lvl_thr;
   std::atomic<size_t> hi_water { 1 };
 
   typedef T value_type;
@@ -206,7 +238,7 @@ struct skip_list
   typedef const T& const_reference;
   typedef T* pointer;
   typedef const T* const_pointer;
-  typedef skip_list<T, Cmp, Alloc> _Self;
+  typedef skip_list<T, Cmp, Alloc, Domain> _Self;
   typedef detail::sl_node<T, Nalloc> _Node;
 
   uintptr_t _Head () const
@@ -219,38 +251,46 @@ struct skip_list
       return (this->hi_water.load (std::memory_order_relaxed));
     }
 
-  void _Init (Cmp c, unsigned int depth)
+  void _Init (Cmp c, unsigned int depth, double prob)
     {
       this->cmpfn = c;
       if ((this->max_depth = depth) > detail::SL_MAX_DEPTH)
         this->max_depth = detail::SL_MAX_DEPTH;
 
+      this->lvl_thr = _Node::lvl_threshold (prob);
+
       this->head.store (_Node::make_root (this->max_depth + 1),
                         std::memory_order_relaxed);
     }
 
-  skip_list (Cmp c = Cmp (), unsigned int depth = detail::SL_MAX_DEPTH)
+  skip_list (Cmp c = Cmp (), unsigned int depth = detail::SL_MAX_DEPTH,
+             double prob = detail::SL_LEVEL_PROB)
     {
-      this->_Init (c, depth);
+      this->_Init (c, depth, prob);
     }
 
   template <typename Iter>
   skip_list (Iter first, Iter last, Cmp c = Cmp (),
-             unsigned int depth = detail::SL_MAX_DEPTH)
+             unsigned int depth = detail::SL_MAX_DEPTH,
+             double prob = detail::SL_LEVEL_PROB)
     {
-      this->_Init (c, depth);
+      this->_Init (c, depth, prob);
       for (; first != last; ++first)
         this->insert (*first);
     }
 
   skip_list (std::initializer_list<T> lst, Cmp c = Cmp (),
-             unsigned int depth = detail::SL_MAX_DEPTH) :
-        skip_list (lst.begin (), lst.end (), c, depth)
+             unsigned int depth = detail::SL_MAX_DEPTH,
+             double prob = detail::SL_LEVEL_PROB) :
+        skip_list (lst.begin (), lst.end (), c, depth, prob)
     {
     }
 
-  skip_list (const _Self& right) : skip_list (right.begin (), right.end ())
+  skip_list (const _Self& right) : skip_list (right.cmpfn, right.max_depth)
     {
+      this->lvl_thr = right.lvl_thr;
+      for (const auto& val : right)
+        this->insert (val);
     }
 
   skip_list (_Self&& right) noexcept
@@ -259,13 +299,14 @@ struct skip_list
                         std::memory_order_relaxed);
       this->cmpfn = right.cmpfn;
       this->max_depth = right.max_depth;
+      this->lvl_thr = right.lvl_thr;
       this->hi_water.store (right.hi_water.load (std::memory_order_relaxed),
                             std::memory_order_relaxed);
 
       right.head.store (nullptr, std::memory_order_relaxed);
     }
 
-  struct iterator : public cs_guard
+  struct iterator : public domain_guard<Domain>
     {
       uintptr_t node;
 
@@ -312,7 +353,7 @@ struct skip_list
 
       const T& operator* () const
         {
-          return (skip_list<T, Cmp, Alloc>::_Getk (this->node));
+          return (skip_list<T, Cmp, Alloc, Domain>::_Getk (this->node));
         }
 
       const T* operator-> () const
@@ -418,14 +459,14 @@ struct skip_list
 
   std::optional<T> find (const T& key) const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       uintptr_t rv = this->_Find_preds (0, key, detail::SL_UNLINK_NONE);
       return (rv ? std::optional<T> (this->_Getk (rv)) : std::nullopt);
     }
 
   bool contains (const T& key) const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       return (this->_Find_preds (0, key, detail::SL_UNLINK_NONE) != 0);
     }
 
@@ -434,7 +475,7 @@ struct skip_list
       uintptr_t preds[detail::SL_MAX_DEPTH], succs[detail::SL_MAX_DEPTH];
       detail::init_preds_succs (preds, succs);
 
-      cs_guard g;
+      domain_guard<Domain> g;
       this->_Find_preds (0, key, detail::SL_UNLINK_NONE, preds, succs);
 
       uintptr_t it_val;
@@ -451,7 +492,7 @@ struct skip_list
 
   const_iterator upper_bound (const T& key) const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       uintptr_t it = this->_Find_preds (0, key, detail::SL_UNLINK_SKIP);
       const_iterator ret { it };
       if (it)
@@ -467,7 +508,8 @@ struct skip_list
 
       detail::init_preds_succs (preds, succs);
 
-      size_t n = _Node::rand_lvl (this->hi_water);
+      size_t n = _Node::rand_lvl (this->hi_water, this->lvl_thr,
+                                       this->max_depth);
       if (this->_Find_preds (n, key, detail::SL_UNLINK_ASSIST,
                              preds, succs, &xroot) != 0)
         return (false);
@@ -515,7 +557,7 @@ struct skip_list
 
   bool insert (const T& key)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       return (this->_Insert (key));
     }
 
@@ -553,19 +595,19 @@ struct skip_list
       // Unlink the item.
       this->_Find_preds (0, key, detail::SL_UNLINK_FORCE);
       _Node::bump (_Node::plen (xroot), -1);
-      finalize (nodep);
+      Domain::finalize (nodep);
       return (it);
     }
 
   bool erase (const T& key)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       return (this->_Erase (key) != 0);
     }
 
   std::optional<T> remove (const T& key)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       uintptr_t it = this->_Erase (key);
       return (it ? std::optional<T> (_Self::_Getk (it)) : std::nullopt);
     }
@@ -602,7 +644,7 @@ struct skip_list
 
   size_t size () const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       auto nx = this->head.load (std::memory_order_relaxed);
       return (nx ? (nx->next[-1] >> 1) : 0);
     }
@@ -627,7 +669,7 @@ struct skip_list
           if (Destroy)
             _Node::get(run)->safe_destroy ();
           else
-            finalize (_Node::get (run));
+            Domain::finalize (_Node::get (run));
 
           run = next;
         }
@@ -635,7 +677,7 @@ struct skip_list
 
   void _Lock_root ()
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       while (true)
         {
           auto ptr = _Node::plen ((uintptr_t)
@@ -652,9 +694,18 @@ struct skip_list
   template <typename Iter>
   void assign (Iter first, Iter last)
     {
-      _Self tmp (first, last);
+      // Build the new nodes with our own comparator and level settings.
+      _Self tmp (this->cmpfn, this->max_depth);
+      tmp.lvl_thr = this->lvl_thr;
+      for (; first != last; ++first)
+        tmp.insert (*first);
+
       auto tp = tmp.head.load (std::memory_order_relaxed);
       tmp.head.store (this->head.exchange (tp, std::memory_order_acq_rel));
+
+      auto tw = tmp._Hiwater ();
+      if (tw > this->_Hiwater ())
+        this->hi_water.store (tw, std::memory_order_relaxed);
     }
 
   void assign (std::initializer_list<T> lst)
@@ -671,6 +722,12 @@ struct skip_list
 
   _Self& operator= (_Self&& right) noexcept
     {
+      // The root was sized for RIGHT's depth, so take its settings too.
+      this->cmpfn = right.cmpfn;
+      this->max_depth = right.max_depth;
+      this->lvl_thr = right.lvl_thr;
+      this->hi_water.store (right._Hiwater (), std::memory_order_relaxed);
+
       auto tp = right.head.load (std::memory_order_relaxed);
       this->_Fini_root<> (this->head.exchange (tp, std::memory_order_acq_rel));
       right.head.store (nullptr, std::memory_order_relaxed);
@@ -691,6 +748,11 @@ struct skip_list
       this->hi_water.store (rw, std::memory_order_relaxed);
       right.hi_water.store (lw, std::memory_order_relaxed);
 
+      // Levels are capped by the depth of the root they're linked to.
+      std::swap (this->cmpfn, right.cmpfn);
+      std::swap (this->max_depth, right.max_depth);
+      std::swap (this->lvl_thr, right.lvl_thr);
+
       auto lh = this->head.load (std::memory_order_relaxed);
       auto rh = right.head.load (std::memory_order_relaxed);
 
@@ -708,40 +770,40 @@ struct skip_list
       this->_Fini_root<> (prev);
     }
 
-  template <typename T2, typename C2, typename A2>
-  bool operator== (const skip_list<T2, C2, A2>& right) const
+  template <typename T2, typename C2, typename A2, typename D2>
+  bool operator== (const skip_list<T2, C2, A2, D2>& right) const
     {
       return (detail::sequence_eq (this->cbegin (), this->cend (),
                                    right.cbegin (), right.cend ()));
     }
 
-  template <typename T2, typename C2, typename A2>
-  bool operator!= (const skip_list<T2, C2, A2>& right) const
+  template <typename T2, typename C2, typename A2, typename D2>
+  bool operator!= (const skip_list<T2, C2, A2, D2>& right) const
     {
       return (!(*this == right));
     }
 
-  template <typename T2, typename C2, typename A2>
-  bool operator< (const skip_list<T2, C2, A2>& right) const
+  template <typename T2, typename C2, typename A2, typename D2>
+  bool operator< (const skip_list<T2, C2, A2, D2>& right) const
     {
       return (detail::sequence_lt (this->cbegin (), this->cend (),
                                    right.cbegin (), right.cend ()));
     }
 
-  template <typename T2, typename C2, typename A2>
-  bool operator> (const skip_list<T2, C2, A2>& right) const
+  template <typename T2, typename C2, typename A2, typename D2>
+  bool operator> (const skip_list<T2, C2, A2, D2>& right) const
     {
       return (right < *this);
     }
 
-  template <typename T2, typename C2, typename A2>
-  bool operator<= (const skip_list<T2, C2, A2>& right) const
+  template <typename T2, typename C2, typename A2, typename D2>
+  bool operator<= (const skip_list<T2, C2, A2, D2>& right) const
     {
       return (!(right < *this));
     }
 
-  template <typename T2, typename C2, typename A2>
-  bool operator>= (const skip_list<T2, C2, A2>& right) const
+  template <typename T2, typename C2, typename A2, typename D2>
+  bool operator>= (const skip_list<T2, C2, A2, D2>& right) const
     {
       return (!(*this < right));
     }
@@ -757,9 +819,9 @@ struct skip_list
 namespace std
 {
 
-template <typename T, typename Cmp, typename Alloc>
-void swap (xrcu::skip_list<T, Cmp, Alloc>& left,
-           xrcu::skip_list<T, Cmp, Alloc>& right)
+template <typename T, typename Cmp, typename Alloc, typename Domain>
+void swap (xrcu::skip_list<T, Cmp, Alloc, Domain>& left,
+           xrcu::skip_list<T, Cmp, Alloc, Domain>& right)
 {
   left.swap (right);
 }
@@ -18,6 +18,7 @@
 #ifndef __XRCU_STACK_HPP__
 #define __XRCU_STACK_HPP__   1
 
+#include "memory.hpp"
 #include "utils.hpp"
 #include "xrcu.hpp"
 
@@ -60,7 +61,8 @@ struct stack_node_base
   static size_t size (const ptr_type& head);
 };
 
-struct stack_iter_base : public cs_guard
+template <typename Domain>
+struct stack_iter_base : public domain_guard<Domain>
 {
   stack_node_base *runp;
 
@@ -99,7 +101,8 @@ struct stack_iter_base : public cs_guard
 
 } // namespace detail.
 
-template <typename T, typename Alloc = std::allocator<T>>
+template <typename T, typename Alloc = std::allocator<T>,
+          typename Domain = default_domain>
 struct stack
 {
   struct _Stknode : public detail::stack_node_base, finalizable
@@ -144,7 +147,16 @@ struct stack
 
       void safe_destroy ()
         {
-          stack<T, Alloc>::_Clean_nodes (this);
+          stack<T, Alloc, Domain>::_Clean_nodes (this);
+        }
+
+      size_t fin_size () const
+        { // The rest of the chain is destroyed along with this node.
+          size_t n = 1;
+          for (auto runp = this->next; runp; runp = runp->next)
+            ++n;
+
+          return (n * sizeof (*this));
         }
     };
 
@@ -177,7 +189,7 @@ struct stack
       while (runp)
         {
           auto tmp = runp->next;
-          stack<T, Alloc>::_Destroy ((_Stknode *)runp);
+          stack<T, Alloc, Domain>::_Destroy ((_Stknode *)runp);
           runp = tmp;
         }
     }
@@ -241,11 +253,12 @@ struct stack
     {
     }
 
-  stack (const stack<T, Alloc>& right) : stack (right.begin (), right.end ())
+  stack (const stack<T, Alloc, Domain>& right) :
+      stack (right.begin (), right.end ())
     {
     }
 
-  stack (stack<T, Alloc>&& right) noexcept
+  stack (stack<T, Alloc, Domain>&& right) noexcept
     {
       this->_Reset (right._Root ());
       right._Reset (nullptr);
@@ -253,7 +266,7 @@ struct stack
 
   void push (const T& value)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       detail::stack_node_base::push (this->hnode, _Stknode::alloc (value));
     }
 
@@ -316,28 +329,28 @@ struct stack
   template <typename T1, typename T2>
   void push (T1 first, T2 last)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       this->_Push (first, last, typename std::is_integral<T1>::type ());
     }
 
   template <typename...Args>
   void emplace (Args&& ...args)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       auto np = _Stknode::move (std::forward<Args>(args)...);
       detail::stack_node_base::push (this->hnode, np);
     }
 
   std::optional<T> pop ()
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       auto node = detail::stack_node_base::pop (this->hnode);
 
       if (!node)
         return (std::nullopt);
 
       std::optional<T> ret { ((node_type *)node)->value };
-      finalize ((node_type *)node);
+      Domain::finalize ((node_type *)node);
       return (ret);
     }
 
@@ -353,28 +366,28 @@ struct stack
 
   std::optional<T> top ()
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       auto node = this->_Root ();
       return (node ? std::optional<T> { node->value } : std::nullopt);
     }
 
-  struct iterator : public detail::stack_iter_base
+  struct iterator : public detail::stack_iter_base<Domain>
     {
       typedef T value_type;
       typedef T& reference;
       typedef T* pointer;
 
       iterator (detail::stack_node_base *rp = nullptr) :
-          detail::stack_iter_base (rp)
+          detail::stack_iter_base<Domain> (rp)
         {
         }
 
-      iterator (const iterator& it) : detail::stack_iter_base (it)
+      iterator (const iterator& it) : detail::stack_iter_base<Domain> (it)
         {
         }
 
       iterator (iterator&& it) noexcept :
-          detail::stack_iter_base (std::move (it))
+          detail::stack_iter_base<Domain> (std::move (it))
         {
         }
 
@@ -446,7 +459,7 @@ struct stack
 
   size_t size () const
     {
-      cs_guard g;
+      domain_guard<Domain> g;
       return (detail::stack_node_base::size (this->hnode));
     }
 
@@ -460,17 +473,17 @@ struct stack
       return (this->_Root () == nullptr);
     }
 
-  void swap (stack<T, Alloc>& right)
+  void swap (stack<T, Alloc, Domain>& right)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
 
       if (this != &right)
         detail::stack_node_base::swap (this->hnode, right.hnode);
     }
 
-  stack<T, Alloc>& operator= (const stack<T, Alloc>& right)
+  stack<T, Alloc, Domain>& operator= (const stack<T, Alloc, Domain>& right)
     {
-      cs_guard g;
+      domain_guard<Domain> g;
 
       if (this != &right)
         this->assign (right.begin (), right.end ());
@@ -478,48 +491,48 @@ struct stack
       return (*this);
     }
 
-  stack<T, Alloc>& operator= (stack<T, Alloc>&& right) noexcept
+  stack<T, Alloc, Domain>& operator= (stack<T, Alloc, Domain>&& right) noexcept
     {
       this->swap (right);
-      finalize (right._Root ());
+      Domain::finalize (right._Root ());
       right._Reset (nullptr);
       return (*this);
     }
 
-  template <typename T2, typename A2>
-  bool operator== (const stack<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator== (const stack<T2, A2, D2>& right) const
     {
       return (detail::sequence_eq (this->cbegin (), this->cend (),
                                    right.cbegin (), right.cend ()));
     }
 
-  template <typename T2, typename A2>
-  bool operator!= (const stack<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator!= (const stack<T2, A2, D2>& right) const
     {
       return (!(*this == right));
     }
 
-  template <typename T2, typename A2>
-  bool operator< (const stack<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator< (const stack<T2, A2, D2>& right) const
     {
       return (detail::sequence_lt (this->cbegin (), this->cend (),
                                    right.cbegin (), right.cend ()));
     }
 
-  template <typename T2, typename A2>
-  bool operator> (const stack<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator> (const stack<T2, A2, D2>& right) const
     {
       return (right < *this);
     }
 
-  template <typename T2, typename A2>
-  bool operator<= (const stack<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator<= (const stack<T2, A2, D2>& right) const
     {
       return (!(right < *this));
     }
 
-  template <typename T2, typename A2>
-  bool operator>= (const stack<T2, A2>& right) const
+  template <typename T2, typename A2, typename D2>
+  bool operator>= (const stack<T2, A2, D2>& right) const
     {
       return (!(*this < right));
     }
@@ -527,15 +540,15 @@ struct stack
   void clear ()
     {
       auto prev = detail::stack_node_base::clear (this->hnode);
-      finalize ((node_type *)prev);
+      Domain::finalize ((node_type *)prev);
     }
 
   template <typename T1, typename T2>
   void assign (T1 first, T2 last)
     {
-      auto tmp = stack<T, Alloc> (first, last);
+      auto tmp = stack<T, Alloc, Domain> (first, last);
       this->swap (tmp);
-      finalize (tmp._Root ());
+      Domain::finalize (tmp._Root ());
       tmp._Reset (nullptr);
     }
 
@@ -560,8 +573,9 @@ struct stack
 namespace std
 {
 
-template <typename T, typename Alloc>
-void swap (xrcu::stack<T, Alloc>& left, xrcu::stack<T, Alloc>& right)
+template <typename T, typename Alloc, typename Domain>
+void swap (xrcu::stack<T, Alloc, Domain>& left,
+           xrcu::stack<T, Alloc, Domain>& right)
 {
   left.swap (right);
 }
@@ -22,6 +22,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <type_traits>
 #include <utility>
 
 namespace xrcu
@@ -95,9 +96,31 @@ struct alignas (8) type_wrapper : public type_wrapper_base<T>
       destroy<T> (&this->value);
       Alloc().deallocate (this, 1);
     }
+
+  static void destroy_batch (finalizable **objs, size_t n)
+    {
+      if (!std::is_trivially_destructible<T>::value)
+        for (size_t i = 0; i < n; ++i)
+          destroy<T> (&static_cast<Self *> (objs[i])->value);
+
+      Alloc alloc;
+      for (size_t i = 0; i < n; ++i)
+        alloc.deallocate (static_cast<Self *> (objs[i]), 1);
+    }
+
+  finalizable::batch_fn fin_batch () const
+    {
+      return (destroy_batch);
+    }
+
+  size_t fin_size () const
+    {
+      return (sizeof (*this));
+    }
 };
 
-template <bool Integral, typename T, typename Alloc>
+template <bool Integral, typename T, typename Alloc,
+          typename Domain = default_domain>
 struct wrapped_traits
 {
   static const uintptr_t XBIT = (uintptr_t)1 << (sizeof (uintptr_t) * 8 - 1);
@@ -119,8 +142,8 @@ struct wrapped_traits
   static void free (uintptr_t) {}
 };
 
-template <typename T, typename Alloc>
-struct wrapped_traits<false, T, Alloc>
+template <typename T, typename Alloc, typename Domain>
+struct wrapped_traits<false, T, Alloc, Domain>
 {
   static const uintptr_t XBIT = 1;
   static const uintptr_t FREE = 2;
@@ -152,7 +175,7 @@ struct wrapped_traits<false, T, Alloc>
 
   static void destroy (uintptr_t addr)
     {
-      finalize ((wrapped_type *)addr);
+      Domain::finalize ((wrapped_type *)addr);
     }
 
   static void free (uintptr_t addr)
@@ -18,17 +18,178 @@
 #ifndef __XRCU_HPP__
 #define __XRCU_HPP__   1
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#if defined (__linux__) && defined (_GNU_SOURCE)
+#  include <sched.h>
+#endif
+
+#if defined (__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#  include <coroutine>
+#  define XRCU_HAVE_COROUTINES   1
+#endif
+
+#ifdef __GNUC__
+#  define XRCU_TLS   __thread
+#  define XRCU_UNLIKELY(x)   __builtin_expect (!!(x), 0)
+#else
+#  define XRCU_TLS   thread_local
+#  define XRCU_UNLIKELY(x)   (x)
+#endif
+
 namespace xrcu
 {
 
+namespace detail
+{
+
+static const uintptr_t GP_PHASE_BIT =
+  (uintptr_t)1 << (sizeof (uintptr_t) * 8 - 1);
+
+static const uintptr_t GP_NEST_MASK = GP_PHASE_BIT - 1;
+
+// Registry state, as used by the inline fast paths.
+struct gp_state
+{
+  std::atomic_uintptr_t counter;
+  // Set while a writer is sleeping, waiting for readers to exit.
+  std::atomic<int> waiting;
+  // Index in the thread-local reader tables, and unique identifier.
+  unsigned int slot;
+  uintptr_t id;
+};
+
+// Thread-specific reader state, as used by the inline fast paths.
+struct tl_reader
+{
+  std::atomic_uintptr_t counter;
+  gp_state *gp;
+  // Identifier of the domain this reader belongs to.
+  uintptr_t id;
+  bool must_flush;
+  // Set if writers issue memory barriers on behalf of readers.
+  bool asym;
+};
+
+// Set once the calling thread is registered.
+extern XRCU_TLS tl_reader *tl_self;
+
+// Readers for the calling thread, indexed by domain slot.
+extern XRCU_TLS tl_reader **tl_slots;
+extern XRCU_TLS unsigned int tl_nslots;
+
+inline tl_reader*
+tl_lookup (const gp_state *gp)
+{
+  unsigned int ix = gp->slot;
+  if (ix < tl_nslots)
+    {
+      auto self = tl_slots[ix];
+      // Slots are reused, so make sure the domain is the same one.
+      if (self && self->id == gp->id)
+        return (self);
+    }
+
+  return (nullptr);
+}
+
+inline void
+rd_store (tl_reader *self, uintptr_t val)
+{
+#if defined (__i386__) || defined (__x86_64__)
+  // Release stores are as cheap as relaxed ones here.
+  self->counter.store (val, std::memory_order_release);
+#else
+  if (self->asym)
+    self->counter.store (val, std::memory_order_relaxed);
+  else
+    self->counter.store (val, std::memory_order_release);
+#endif
+}
+
+// Slow paths for the functions below.
+extern tl_reader* tl_register ();
+extern tl_reader* tl_register (gp_state *gp);
+extern void tl_exit (tl_reader *self);
+
+inline void
+rd_enter (tl_reader *self)
+{
+  auto val = self->counter.load (std::memory_order_relaxed);
+  val = (val & GP_NEST_MASK) == 0 ?
+        self->gp->counter.load (std::memory_order_relaxed) : val + 1;
+
+  rd_store (self, val);
+  std::atomic_signal_fence (std::memory_order_seq_cst);
+}
+
+inline void
+rd_exit (tl_reader *self)
+{
+  auto val = self->counter.load (std::memory_order_relaxed) - 1;
+
+  std::atomic_signal_fence (std::memory_order_seq_cst);
+  rd_store (self, val);
+
+  if ((val & GP_NEST_MASK) == 0 &&
+      XRCU_UNLIKELY (self->must_flush ||
+                     self->gp->waiting.load (std::memory_order_relaxed)))
+    tl_exit (self);
+}
+
+inline bool
+rd_in_cs (const tl_reader *self)
+{
+  return (self && (self->counter.load (std::memory_order_relaxed) &
+                   GP_NEST_MASK) != 0);
+}
+
+} // namespace detail
+
 // Enter a read-side critical section.
-extern void enter_cs ();
+inline void
+enter_cs ()
+{
+  auto self = detail::tl_self;
+  if (XRCU_UNLIKELY (!self))
+    self = detail::tl_register ();
+
+  detail::rd_enter (self);
+}
 
 // Exit a read-side critical section.
-extern void exit_cs ();
+inline void
+exit_cs ()
+{
+  detail::rd_exit (detail::tl_self);
+}
 
 // Test if the calling thread is in a read-side critical section.
-extern bool in_cs ();
+inline bool
+in_cs ()
+{
+  return (detail::rd_in_cs (detail::tl_self));
+}
+
+/*
+ * Register the calling thread with the RCU subsystem. This is done
+ * automatically on first use, but it can be done in advance to take
+ * the cost out of the first critical section (i.e: in thread pools).
+ */
+extern void register_thread ();
+
+/*
+ * Unregister the calling thread, reclaiming its pending finalizable objects.
+ * Returns false if the thread is in a critical section, true otherwise.
+ */
+extern bool unregister_thread ();
 
 /*
  * Wait until all readers have entered a quiescent state.
@@ -36,9 +197,37 @@ extern bool in_cs ();
  */
 extern bool sync ();
 
+/*
+ * Same as above, but give up once TIMEOUT has elapsed. Returns true if
+ * a full grace period elapsed, false on timeout or deadlock.
+ */
+extern bool sync_for (std::chrono::nanoseconds timeout);
+
+/*
+ * Get a cookie that can be used to test if a full grace period has
+ * elapsed since this call.
+ */
+extern uintptr_t get_state ();
+
+// Same as above, but also make sure a grace period is started.
+extern uintptr_t start_poll ();
+
+// Test if a full grace period has elapsed since COOKIE was obtained.
+extern bool poll_state (uintptr_t cookie);
+
+/*
+ * Wait until a full grace period has elapsed since COOKIE was obtained,
+ * returning immediately if that's already the case. Returns false if a
+ * deadlock is detected, true otherwise.
+ */
+extern bool cond_sync (uintptr_t cookie);
+
 // Base type for finalizable objects.
 struct finalizable
 {
+  // Function that destroys N objects of the same type at once.
+  typedef void (*batch_fn) (finalizable **objs, size_t n);
+
   finalizable *_Fin_next = nullptr;
 
   virtual void safe_destroy ()
@@ -46,6 +235,26 @@ struct finalizable
       ::delete this;
     }
 
+  /*
+   * Number of bytes that are released when the object is destroyed. Used
+   * to bound the memory held by pending objects, so it must return the same
+   * value every time. Objects that don't know are only counted by number.
+   */
+  virtual size_t fin_size () const
+    {
+      return (0);
+    }
+
+  /*
+   * Objects that return the same function here are grouped when they are
+   * finalized, and destroyed by a single call to it instead of calling
+   * 'safe_destroy' on each one. The default is to not group them.
+   */
+  virtual batch_fn fin_batch () const
+    {
+      return (nullptr);
+    }
+
   virtual ~finalizable () {}
 };
 
@@ -58,6 +267,239 @@ extern void finalize (finalizable *finp);
  */
 extern bool flush_finalizers ();
 
+/*
+ * Set whether pending finalizable objects are handed off to a background
+ * thread for reclamation, instead of being reclaimed by the thread that
+ * finalized them. Returns the previous setting. Disabling it waits for the
+ * background thread, so it fails and returns false, leaving the setting
+ * unchanged, if the calling thread holds references in any domain.
+ */
+extern bool async_reclaim (bool enable);
+
+// Test if background reclamation is enabled.
+extern bool async_reclaim ();
+
+/*
+ * Set the limit for the number of bytes held by pending finalizable objects
+ * across all threads, or zero for no limit. Once the limit is exceeded,
+ * threads reclaim their pending objects right away, waiting for a grace
+ * period if necessary. Returns the previous setting.
+ */
+extern size_t memory_budget (size_t bytes);
+
+// Get the current limit for pending objects.
+extern size_t memory_budget ();
+
+// Get the (approximate) number of bytes held by pending objects.
+extern size_t pending_bytes ();
+
+/*
+ * Runtime statistics. Unless the library was configured with statistics
+ * enabled, only the number of grace periods and pending bytes are kept
+ * track of; the rest of the values are always zero.
+ */
+struct rcu_stats
+{
+  static const unsigned int SYNC_BUCKETS = 16;
+
+  // Number of completed grace periods, in every domain.
+  uint64_t grace_periods;
+  /*
+   * Latency of calls to 'sync' and its variants. The first bucket counts
+   * calls that took less than a microsecond; bucket N counts calls that
+   * took less than 2^N microseconds, and the last one, everything else.
+   */
+  uint64_t sync_latency[SYNC_BUCKETS];
+  // Number of times writers looked at the readers while waiting for them.
+  uint64_t poll_loops;
+  // Number of times writers went to sleep while waiting for readers.
+  uint64_t sleeps;
+  // Pending finalizable objects (and callback blocks), and their bytes.
+  uint64_t pending_fins;
+  uint64_t pending_bytes;
+  // Number of times a thread's pending objects were reclaimed or handed off.
+  uint64_t flushes;
+  // Number of times that had to be deferred, because of a critical section.
+  uint64_t deferred_flushes;
+};
+
+// Get a snapshot of the runtime statistics.
+extern rcu_stats stats ();
+
+/*
+ * Called with the thread id of a reader that stalls a grace period, and
+ * how long it has been in its critical section (at least).
+ */
+typedef void (*stall_handler) (std::thread::id tid,
+                               std::chrono::nanoseconds elapsed);
+
+/*
+ * Call FN whenever a grace period has been waiting on a reader for longer
+ * than THRESHOLD. FN is called by the thread running the grace period, at
+ * most once per reader and grace period, and must not wait for one itself.
+ * A null FN disables stall detection.
+ */
+extern void stall_detection (stall_handler fn,
+                             std::chrono::nanoseconds threshold);
+
+namespace detail
+{
+
+// Storage for a deferred callback.
+struct cb_slot
+{
+  void (*fn) (void *);
+  alignas (void *) unsigned char buf[3 * sizeof (void *)];
+};
+
+// Get a free slot in the pending callbacks for SELF.
+extern cb_slot* cb_alloc (tl_reader *self);
+
+// Account for a callback that was stored in the last allocated slot.
+extern void cb_commit (tl_reader *self);
+
+extern void finalize (tl_reader *self, finalizable *finp);
+
+template <typename Fn>
+void cb_call (void *ptr)
+{
+  auto fp = (Fn *)ptr;
+  (*fp) ();
+  fp->~Fn ();
+}
+
+// Wrapper for callbacks that don't fit in a slot.
+template <typename Fn>
+struct cb_fin : public finalizable
+{
+  Fn fn;
+
+  template <typename F>
+  explicit cb_fin (F&& f) : fn (std::forward<F> (f))
+    {
+    }
+
+  void safe_destroy ()
+    {
+      this->fn ();
+      ::delete this;
+    }
+};
+
+template <typename F>
+void defer (tl_reader *self, F&& fn)
+{
+  typedef typename std::decay<F>::type Fn;
+
+  if constexpr (sizeof (Fn) <= sizeof (cb_slot::buf) &&
+                alignof (Fn) <= alignof (cb_slot))
+    {
+      auto slot = cb_alloc (self);
+      new (slot->buf) Fn (std::forward<F> (fn));
+      slot->fn = cb_call<Fn>;
+      cb_commit (self);
+    }
+  else
+    finalize (self, new cb_fin<Fn> (std::forward<F> (fn)));
+}
+
+} // namespace detail
+
+/*
+ * Call FN after a grace period, in place of a finalizable object. Small
+ * callables are stored in blocks that are shared among callbacks, so this
+ * needs no additional allocation in the common case.
+ */
+template <typename F>
+void defer (F&& fn)
+{
+  auto self = detail::tl_self;
+  if (XRCU_UNLIKELY (!self))
+    self = detail::tl_register ();
+
+  detail::defer (self, std::forward<F> (fn));
+}
+
+namespace detail
+{
+
+/*
+ * Destroy FINP from the background thread, once a grace period has elapsed
+ * in GP, or in the global domain if it's null. Objects queued this way by any
+ * number of threads share a single grace period.
+ */
+extern void finalize_async (gp_state *gp, finalizable *finp);
+
+#ifdef XRCU_HAVE_COROUTINES
+
+// Awaitable that suspends a coroutine until a grace period has elapsed.
+template <typename Exec>
+struct gp_awaiter : public finalizable
+{
+  gp_state *gp;
+  Exec exec;
+  std::coroutine_handle<> coro;
+
+  gp_awaiter (gp_state *sp, Exec ex) : gp (sp), exec (std::move (ex))
+    {
+    }
+
+  bool await_ready () const noexcept
+    {
+      return (false);
+    }
+
+  void await_suspend (std::coroutine_handle<> h)
+    {
+      this->coro = h;
+      finalize_async (this->gp, this);
+    }
+
+  void await_resume () const noexcept
+    {
+    }
+
+  void safe_destroy ()
+    {
+      // We live in the coroutine frame, which may be gone once it resumes.
+      auto ex = std::move (this->exec);
+      ex (this->coro);
+    }
+};
+
+#endif
+
+} // namespace detail
+
+#ifdef XRCU_HAVE_COROUTINES
+
+/*
+ * Executor that resumes a coroutine right away, in the calling thread. When
+ * used with 'grace_period', that's the thread that reclaims objects for every
+ * domain, so the coroutine must not block or wait for a grace period until
+ * it suspends again, or it holds up reclamation everywhere.
+ */
+struct inline_executor
+{
+  void operator() (std::coroutine_handle<> coro) const
+    {
+      coro.resume ();
+    }
+};
+
+/*
+ * Use as 'co_await grace_period (EX)' to suspend the calling coroutine until
+ * a grace period has elapsed. The coroutine is then resumed by calling EX with
+ * its handle, from a background thread.
+ */
+template <typename Exec>
+detail::gp_awaiter<Exec> grace_period (Exec ex)
+{
+  return (detail::gp_awaiter<Exec> (nullptr, std::move (ex)));
+}
+
+#endif
+
 struct cs_guard
 {
   cs_guard ()
@@ -71,6 +513,371 @@ struct cs_guard
     }
 };
 
+namespace detail
+{
+
+// Functionality shared by every kind of domain.
+class domain_base
+{
+protected:
+  gp_state *gp;
+
+  explicit domain_base (gp_state *sp) : gp (sp)
+    {
+    }
+
+  // Kinds of domains, other than the default one.
+  static const unsigned int DOM_QSBR = 1;
+  static const unsigned int DOM_SRCU = 2;
+
+  explicit domain_base (unsigned int kind);
+
+  /*
+   * No thread may be in a critical section of the domain, or use it
+   * in any other way, while it's being destroyed.
+   */
+  ~domain_base ();
+
+  tl_reader* reader () const
+    {
+      auto self = tl_lookup (this->gp);
+      if (XRCU_UNLIKELY (!self))
+        self = tl_register (this->gp);
+
+      return (self);
+    }
+
+public:
+  domain_base (const domain_base&) = delete;
+  domain_base& operator= (const domain_base&) = delete;
+
+  // These work the same as their free function counterparts.
+  void register_thread ();
+  bool unregister_thread ();
+  bool sync ();
+  bool sync_for (std::chrono::nanoseconds timeout);
+  uintptr_t get_state ();
+  uintptr_t start_poll ();
+  bool poll_state (uintptr_t cookie);
+  bool cond_sync (uintptr_t cookie);
+  void finalize (finalizable *finp);
+  bool flush_finalizers ();
+
+  template <typename F>
+  void defer (F&& fn)
+    {
+      detail::defer (this->reader (), std::forward<F> (fn));
+    }
+
+#ifdef XRCU_HAVE_COROUTINES
+  template <typename Exec>
+  gp_awaiter<Exec> grace_period (Exec ex)
+    {
+      return (gp_awaiter<Exec> (this->gp, std::move (ex)));
+    }
+#endif
+};
+
+} // namespace detail
+
+/*
+ * An independent RCU domain, with its own readers and finalizable objects.
+ * Critical sections in a domain only delay grace periods in that same domain.
+ * The free functions above operate on the global domain.
+ */
+class rcu_domain : public detail::domain_base
+{
+  explicit rcu_domain (detail::gp_state *sp) : domain_base (sp)
+    {
+    }
+
+public:
+  rcu_domain () : domain_base (0u)
+    {
+    }
+
+  // Get the domain used by the free functions.
+  static rcu_domain& global ();
+
+  void enter_cs ()
+    {
+      detail::rd_enter (this->reader ());
+    }
+
+  void exit_cs ()
+    {
+      detail::rd_exit (detail::tl_lookup (this->gp));
+    }
+
+  bool in_cs () const
+    {
+      return (detail::rd_in_cs (detail::tl_lookup (this->gp)));
+    }
+};
+
+/*
+ * A domain based on quiescent states. Readers don't mark their critical
+ * sections at all; instead, they periodically announce that they hold no
+ * references to shared data, or go offline before blocking.
+ */
+class qsbr_domain : public detail::domain_base
+{
+public:
+  qsbr_domain () : domain_base (DOM_QSBR)
+    {
+    }
+
+  // Register the calling thread and mark it as online.
+  void register_thread ();
+
+  // Announce that the calling thread holds no references to shared data.
+  void quiescent_state ()
+    {
+      auto self = this->reader ();
+      auto prev = self->counter.load (std::memory_order_relaxed);
+
+      self->counter.store (this->gp->counter.load (std::memory_order_acquire),
+                           std::memory_order_release);
+      if (XRCU_UNLIKELY (prev == 0))
+        // Going online - Order the store before any further reads.
+        std::atomic_thread_fence (std::memory_order_seq_cst);
+
+      if (XRCU_UNLIKELY (self->must_flush ||
+                         this->gp->waiting.load (std::memory_order_relaxed)))
+        detail::tl_exit (self);
+    }
+
+  /*
+   * Mark the calling thread as offline (i.e: in an extended quiescent state)
+   * or online again. Offline threads may not access shared data.
+   */
+  void thread_offline ();
+  void thread_online ();
+
+  // Test if the calling thread is online.
+  bool online () const
+    {
+      auto self = detail::tl_lookup (this->gp);
+      return (self && self->counter.load (std::memory_order_relaxed) != 0);
+    }
+};
+
+/*
+ * Containers take a domain policy as their last template parameter. A policy
+ * is a type with the static member functions 'enter_cs', 'exit_cs' and
+ * 'finalize'. This one uses the global domain.
+ */
+struct default_domain
+{
+  static void enter_cs ()
+    {
+      xrcu::enter_cs ();
+    }
+
+  static void exit_cs ()
+    {
+      xrcu::exit_cs ();
+    }
+
+  static void finalize (finalizable *finp)
+    {
+      xrcu::finalize (finp);
+    }
+};
+
+// Policy for the domain D.
+template <rcu_domain& D>
+struct domain_policy
+{
+  static void enter_cs ()
+    {
+      D.enter_cs ();
+    }
+
+  static void exit_cs ()
+    {
+      D.exit_cs ();
+    }
+
+  static void finalize (finalizable *finp)
+    {
+      D.finalize (finp);
+    }
+};
+
+namespace detail
+{
+
+// Per-CPU reader counters for sleepable domains.
+struct alignas (64) srcu_cpu
+{
+  std::atomic_uintptr_t lock[2];
+  std::atomic_uintptr_t unlock[2];
+};
+
+// Indices for the sections the calling thread is in, as a stack of bits.
+extern XRCU_TLS uintptr_t tl_srcu_idx;
+
+/*
+ * Number of sections entered minus those exited by the calling thread, in
+ * every sleepable domain, and whether it has to flush once that drops to 0.
+ */
+extern XRCU_TLS intptr_t tl_srcu_depth;
+extern XRCU_TLS bool tl_srcu_flush;
+
+// Reclaim the objects that were held back by the calling thread's sections.
+extern void srcu_flush ();
+
+// Wake up a writer that is waiting for readers in the domain GP.
+extern void gp_wake (gp_state *gp);
+
+inline unsigned int
+cpu_id ()
+{
+#if defined (__linux__) && defined (_GNU_SOURCE)
+  int ret = sched_getcpu ();
+  if (ret >= 0)
+    return ((unsigned int)ret);
+#endif
+  // Any per-thread value will do, as long as it's spread out.
+  return ((unsigned int)((uintptr_t)&tl_srcu_idx >> 6));
+}
+
+inline void
+srcu_inc_lock (std::atomic_uintptr_t& ctr)
+{
+#if defined (__i386__) || defined (__x86_64__)
+  // Locked instructions are full barriers here.
+  ctr.fetch_add (1, std::memory_order_seq_cst);
+#else
+  ctr.fetch_add (1, std::memory_order_relaxed);
+  std::atomic_thread_fence (std::memory_order_seq_cst);
+#endif
+}
+
+inline void
+srcu_inc_unlock (std::atomic_uintptr_t& ctr)
+{
+#if defined (__i386__) || defined (__x86_64__)
+  ctr.fetch_add (1, std::memory_order_seq_cst);
+#else
+  std::atomic_thread_fence (std::memory_order_seq_cst);
+  ctr.fetch_add (1, std::memory_order_relaxed);
+#endif
+}
+
+} // namespace detail
+
+/*
+ * A domain whose readers may block. Instead of keeping track of threads,
+ * readers increment a pair of counters, spread across CPUs. Readers need
+ * not register, and a reader that sleeps only delays grace periods in
+ * its own domain. Pending objects are always reclaimed in the background.
+ */
+class srcu_domain : public detail::domain_base
+{
+  detail::srcu_cpu *cpus;
+  unsigned int ncpus;
+
+  detail::srcu_cpu& local () const
+    {
+      return (this->cpus[detail::cpu_id () % this->ncpus]);
+    }
+
+public:
+  srcu_domain ();
+
+  // Enter a read-side critical section, returning the value for 'read_unlock'.
+  unsigned int read_lock ()
+    {
+      unsigned int idx = this->gp->counter.load (std::memory_order_relaxed) & 1;
+      detail::srcu_inc_lock (this->local ().lock[idx]);
+      ++detail::tl_srcu_depth;
+      return (idx);
+    }
+
+  // Exit a read-side critical section, entered with the index IDX.
+  void read_unlock (unsigned int idx)
+    {
+      detail::srcu_inc_unlock (this->local ().unlock[idx]);
+      if (XRCU_UNLIKELY (this->gp->waiting.load (std::memory_order_relaxed)))
+        detail::gp_wake (this->gp);
+
+      if (--detail::tl_srcu_depth == 0 && XRCU_UNLIKELY (detail::tl_srcu_flush))
+        detail::srcu_flush ();
+    }
+
+  /*
+   * Same as above, but keep track of the index in a thread-local stack.
+   * Sections entered this way must be properly nested, and up to as many
+   * as the number of bits in an uintptr_t.
+   */
+  void enter_cs ()
+    {
+      detail::tl_srcu_idx = (detail::tl_srcu_idx << 1) | this->read_lock ();
+    }
+
+  void exit_cs ()
+    {
+      unsigned int idx = detail::tl_srcu_idx & 1;
+      detail::tl_srcu_idx >>= 1;
+      this->read_unlock (idx);
+    }
+};
+
+// Policy for the QSBR domain D. Critical sections are free.
+template <qsbr_domain& D>
+struct qsbr_policy
+{
+  static void enter_cs ()
+    {
+    }
+
+  static void exit_cs ()
+    {
+    }
+
+  static void finalize (finalizable *finp)
+    {
+      D.finalize (finp);
+    }
+};
+
+// Policy for the sleepable domain D.
+template <srcu_domain& D>
+struct srcu_policy
+{
+  static void enter_cs ()
+    {
+      D.enter_cs ();
+    }
+
+  static void exit_cs ()
+    {
+      D.exit_cs ();
+    }
+
+  static void finalize (finalizable *finp)
+    {
+      D.finalize (finp);
+    }
+};
+
+// Same as 'cs_guard', but for a domain policy.
+template <typename Domain>
+struct domain_guard
+{
+  domain_guard ()
+    {
+      Domain::enter_cs ();
+    }
+
+  ~domain_guard ()
+    {
+      Domain::exit_cs ();
+    }
+};
+
 // Miscellaneous functions that don't belong anywhere else.
 struct atfork
 {
@@ -114,6 +921,9 @@ ctz (unsigned int val)
 // Generate a pseudo-random number (thread-safe).
 extern unsigned int xrand ();
 
+// Same as above, but all 64 bits of the result are random.
+extern uint64_t xrand64 ();
+
 // Get the library version.
 extern void library_version (int& major, int& minor);
 